@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+#
+#  Copyright (c) 2011 Jonathon Jongsma
+#
+#  This file is part of soundprint
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, see <http://www.gnu.org/licenses/>
+
+"""End-to-end benchmark for soundprint and sonogen.
+
+Generates a corpus of WAV, FLAC and Ogg Vorbis files with audiotestsrc and
+gst-launch-1.0, then runs each tool over every file a number of times and
+prints one JSON object per tool and corpus entry:
+
+  {"tool": "soundprint", "format": "flac", "rate": 44100, "channels": 2,
+   "length": 30, "runs": 5, "p50_ms": 210.3, "p90_ms": 221.0,
+   "p99_ms": 224.8, "mean_ms": 212.9, "realtime_factor": 23.78,
+   "peak_rss_kb": 31244}
+
+followed by one summary object per tool with "files_per_sec".  The
+realtime factor counts the seconds of audio a tool actually analyses, so
+only --length seconds for soundprint, and is null for sonogen --overview.
+The corpus is kept between runs and only regenerated when its parameters
+change; the default sine signal makes it bit-identical from run to run.
+"""
+
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.parse
+import urllib.request
+
+ENCODERS = {
+    "wav": ["wavenc"],
+    "flac": ["flacenc"],
+    "ogg": ["vorbisenc", "!", "oggmux"],
+}
+
+
+def int_list(value):
+    return [int(v) for v in value.split(",") if v]
+
+
+def str_list(value):
+    return [v for v in value.split(",") if v]
+
+
+def percentile(values, p):
+    """nearest-rank percentile of a sorted list"""
+    index = max(0, min(len(values) - 1, int(round(p / 100.0 * len(values))) - 1))
+    return values[index]
+
+
+def corpus_entries(args):
+    for fmt in args.formats:
+        for rate in args.rates:
+            for channels in args.channels:
+                for length in args.lengths:
+                    name = "%s-%dhz-%dch-%ds.%s" % (args.wave, rate, channels,
+                                                    length, fmt)
+                    yield {"format": fmt, "rate": rate, "channels": channels,
+                           "length": length,
+                           "path": os.path.join(args.corpus, name)}
+
+
+def generate_corpus(args, entries):
+    os.makedirs(args.corpus, exist_ok=True)
+    manifest_path = os.path.join(args.corpus, "manifest.json")
+    manifest = {}
+    if os.path.exists(manifest_path):
+        with open(manifest_path) as f:
+            manifest = json.load(f)
+
+    for entry in entries:
+        name = os.path.basename(entry["path"])
+        if os.path.exists(entry["path"]) and manifest.get(name) == args.wave:
+            continue
+
+        # one argument per token, so that gst-launch escapes the spaces
+        # a corpus path may contain
+        samples_per_buffer = entry["rate"] // 10
+        pipeline = (["audiotestsrc", "wave=%s" % args.wave,
+                     "samplesperbuffer=%d" % samples_per_buffer,
+                     "num-buffers=%d" % (entry["length"] * 10), "!",
+                     "audio/x-raw,rate=%d,channels=%d" % (entry["rate"],
+                                                          entry["channels"]),
+                     "!", "audioconvert", "!"] + ENCODERS[entry["format"]] +
+                    ["!", "filesink", "location=%s" % entry["path"]])
+        print("generating %s" % name, file=sys.stderr)
+        result = subprocess.run([args.gst_launch, "-q"] + pipeline,
+                                stdout=subprocess.DEVNULL)
+        if result.returncode != 0:
+            sys.exit("could not generate %s" % name)
+        manifest[name] = args.wave
+
+    with open(manifest_path, "w") as f:
+        json.dump(manifest, f, indent=1, sort_keys=True)
+
+
+def run_tool(command):
+    """runs command and returns (wall seconds, peak RSS in KiB)"""
+    with tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, stdout=subprocess.DEVNULL,
+                                   stderr=stderr)
+        _, status, rusage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+
+        if process.returncode != 0:
+            stderr.seek(0)
+            sys.stderr.write(stderr.read().decode(errors="replace"))
+            sys.exit("%s failed with %d" % (" ".join(command),
+                                            process.returncode))
+
+    return elapsed, rusage.ru_maxrss
+
+
+def tool_command(args, tool, entry, output):
+    path = os.path.abspath(entry["path"])
+    if tool == "soundprint":
+        uri = urllib.parse.urljoin("file:", urllib.request.pathname2url(path))
+        return ([os.path.join(args.builddir, "soundprint"), "-o", output] +
+                args.soundprint_args + [uri])
+    return ([os.path.join(args.builddir, "sonogen"), "-o", output] +
+            args.sonogen_args + [path])
+
+
+def analysed_seconds(tool, tool_args, length):
+    """seconds of a file of length seconds that tool decodes and analyses,
+    or None when that is not a single stretch of audio"""
+    parser = argparse.ArgumentParser(add_help=False)
+    if tool == "soundprint":
+        parser.add_argument("-l", "--length", type=float, default=5.0)
+        parser.add_argument("--start", type=float, default=0.0)
+        parser.add_argument("--montage", type=int, default=0)
+        opts, _ = parser.parse_known_args(tool_args)
+        # the excerpts of a montage add up to --length within the file
+        start = 0.0 if opts.montage > 0 else opts.start
+        return max(0.0, min(opts.length, length - start))
+
+    parser.add_argument("-d", "--duration", type=float, default=0.0)
+    parser.add_argument("--overview", type=int, default=0)
+    opts, _ = parser.parse_known_args(tool_args)
+    if opts.overview > 0:
+        return None
+    if opts.duration > 0:
+        return min(opts.duration, length)
+    return length
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--builddir", default=".",
+                        help="directory containing the built tools")
+    parser.add_argument("--corpus", default=None,
+                        help="corpus directory (default BUILDDIR/bench/corpus)")
+    parser.add_argument("--formats", type=str_list, default=list(ENCODERS),
+                        help="comma separated formats (default wav,flac,ogg)")
+    parser.add_argument("--rates", type=int_list, default=[22050, 44100, 48000])
+    parser.add_argument("--channels", type=int_list, default=[1, 2])
+    parser.add_argument("--lengths", type=int_list, default=[5, 30],
+                        help="comma separated lengths in seconds")
+    parser.add_argument("--wave", default="sine",
+                        help="audiotestsrc wave, noise is not reproducible")
+    parser.add_argument("--tools", type=str_list,
+                        default=["soundprint", "sonogen"])
+    parser.add_argument("--runs", type=int, default=5,
+                        help="runs per tool and file")
+    # the extra arguments start with a dash themselves, so argparse only
+    # takes them as a value when attached with '='
+    parser.add_argument("--soundprint-args", type=shlex.split, default=[],
+                        metavar="ARGS",
+                        help="extra arguments for soundprint, quoted and "
+                        "attached with '=', e.g. --soundprint-args='--montage 4'")
+    parser.add_argument("--sonogen-args", type=shlex.split, default=[],
+                        metavar="ARGS",
+                        help="extra arguments for sonogen, e.g. "
+                        "--sonogen-args='--overview 8 -w 640'")
+    parser.add_argument("--gst-launch", default="gst-launch-1.0")
+    parser.add_argument("--quick", action="store_true",
+                        help="one format, rate, channel count and length")
+    args = parser.parse_args()
+
+    if args.corpus is None:
+        args.corpus = os.path.join(args.builddir, "bench", "corpus")
+    if args.quick:
+        args.formats = args.formats[:1]
+        args.rates = args.rates[:1]
+        args.channels = args.channels[:1]
+        args.lengths = args.lengths[:1]
+    for fmt in args.formats:
+        if fmt not in ENCODERS:
+            sys.exit("unknown format %s" % fmt)
+
+    entries = list(corpus_entries(args))
+    generate_corpus(args, entries)
+
+    output = os.path.join(tempfile.mkdtemp(), "e2e.png")
+    for tool in args.tools:
+        files = 0
+        total_wall = 0.0
+        all_times = []
+        tool_rss = 0
+
+        tool_args = (args.soundprint_args if tool == "soundprint"
+                     else args.sonogen_args)
+        for entry in entries:
+            command = tool_command(args, tool, entry, output)
+            seconds = analysed_seconds(tool, tool_args, entry["length"])
+            times = []
+            rss = 0
+            for _ in range(args.runs):
+                elapsed, maxrss = run_tool(command)
+                times.append(elapsed)
+                rss = max(rss, maxrss)
+            times.sort()
+
+            files += len(times)
+            total_wall += sum(times)
+            all_times.extend(times)
+            tool_rss = max(tool_rss, rss)
+
+            p50 = percentile(times, 50)
+            print(json.dumps({
+                "tool": tool, "format": entry["format"], "rate": entry["rate"],
+                "channels": entry["channels"], "length": entry["length"],
+                "runs": len(times),
+                "p50_ms": round(p50 * 1000, 3),
+                "p90_ms": round(percentile(times, 90) * 1000, 3),
+                "p99_ms": round(percentile(times, 99) * 1000, 3),
+                "mean_ms": round(sum(times) / len(times) * 1000, 3),
+                "realtime_factor": (round(seconds / p50, 2) if seconds
+                                    else None),
+                "peak_rss_kb": rss}))
+            sys.stdout.flush()
+
+        all_times.sort()
+        print(json.dumps({
+            "tool": tool, "summary": True, "files": files,
+            "wall_s": round(total_wall, 3),
+            "files_per_sec": round(files / total_wall, 3) if total_wall else 0,
+            "p50_ms": round(percentile(all_times, 50) * 1000, 3),
+            "p90_ms": round(percentile(all_times, 90) * 1000, 3),
+            "p99_ms": round(percentile(all_times, 99) * 1000, 3),
+            "peak_rss_kb": tool_rss}))
+        sys.stdout.flush()
+
+    if os.path.exists(output):
+        os.unlink(output)
+    os.rmdir(os.path.dirname(output))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,346 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+/* Microbenchmarks for the hot loops of the plugin and the tools, run on
+ * synthetic data without a pipeline around them.  Every kernel is warmed up
+ * and then timed over a number of repetitions of a batch of calls; the
+ * table shows percentiles of the time per call and the time per item (a
+ * sample, a band or a pixel row, depending on the kernel).
+ *
+ * The element's kernels are static, so the element source is compiled
+ * right into this program.
+ */
+
+#include "gstspectrogram.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static gint repetitions = 200;
+static gint warmup = 20;
+
+static GOptionEntry entries[] = {
+  {"repetitions", 'r', 0, G_OPTION_ARG_INT, &repetitions,
+      "Timed repetitions per kernel (default 200)", "N"},
+  {"warmup", 'w', 0, G_OPTION_ARG_INT, &warmup,
+      "Untimed repetitions per kernel (default 20)", "N"},
+  {NULL}
+};
+
+typedef void (*BenchFunc) (gpointer data);
+
+static int
+compare_times (gconstpointer a, gconstpointer b)
+{
+  GstClockTime ta = *(const GstClockTime *) a;
+  GstClockTime tb = *(const GstClockTime *) b;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+/* times repetitions batches of batch calls to func and prints a row */
+static void
+bench_run (const gchar * name, BenchFunc func, gpointer data, guint batch,
+    guint items)
+{
+  GstClockTime *times = g_new (GstClockTime, repetitions);
+  gint r;
+  guint i;
+
+  for (r = 0; r < warmup; r++)
+    for (i = 0; i < batch; i++)
+      func (data);
+
+  for (r = 0; r < repetitions; r++) {
+    GstClockTime start = gst_util_get_timestamp ();
+
+    for (i = 0; i < batch; i++)
+      func (data);
+    times[r] = (gst_util_get_timestamp () - start) / batch;
+  }
+
+  qsort (times, repetitions, sizeof (GstClockTime), compare_times);
+
+  printf ("%-32s %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+      " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10.2f\n", name,
+      times[0], times[repetitions / 2], times[repetitions * 9 / 10],
+      times[repetitions * 99 / 100], (gdouble) times[repetitions / 2] / items);
+
+  g_free (times);
+}
+
+static gfloat
+random_db (void)
+{
+  return g_random_double_range (-110.0, 0.0);
+}
+
+/* an element set up like for a stream of mono 44.1 kHz audio, with history
+ * and levels full of noise */
+static GstSpectrogram *
+bench_element (guint bands, GstVideoFormat format, gint width, gint height)
+{
+  GstSpectrogram *self;
+  GstVideoInfo info;
+  GstCaps *caps;
+  guint i;
+
+  self = g_object_new (GST_TYPE_SPECTROGRAM, "bands", bands, NULL);
+  gst_object_ref_sink (self);
+
+  self->format_channels = 1;
+  self->rate = 44100;
+  self->bps = sizeof (gint16);
+
+  gst_video_info_set_format (&info, format, width, height);
+  GST_VIDEO_INFO_FPS_N (&info) = 25;
+  GST_VIDEO_INFO_FPS_D (&info) = 1;
+  caps = gst_video_info_to_caps (&info);
+  gst_spectrogram_src_setcaps (self, caps);
+  gst_caps_unref (caps);
+
+  gst_spectrogram_alloc_channel_data (self);
+  for (i = 0; i < self->window_len; i++)
+    self->channel_data[0].input[i] = g_random_double_range (-1.0, 1.0);
+  for (i = 0; i < self->num_bands; i++)
+    self->channel_data[0].spect_magnitude[i] = random_db ();
+  self->num_fft = 1;
+
+  for (i = 0; i < (guint) width; i++)
+    gst_spectrogram_push_spectrum_data (self);
+
+  return self;
+}
+
+/* input readers */
+
+#define READER_FRAMES 1024
+#define READER_CHANNELS 2
+
+typedef struct
+{
+  gint16 in[READER_FRAMES * READER_CHANNELS];
+  gfloat ring[READER_FRAMES];
+} ReaderData;
+
+static void
+bench_input_mixed (gpointer data)
+{
+  ReaderData *d = data;
+
+  input_data_mixed_int16_max ((const guint8 *) d->in, d->ring, READER_FRAMES,
+      READER_CHANNELS, 32767.0f, 0, READER_FRAMES);
+}
+
+static void
+bench_input_single (gpointer data)
+{
+  ReaderData *d = data;
+
+  input_data_int16_max ((const guint8 *) d->in, d->ring, READER_FRAMES,
+      READER_CHANNELS, 32767.0f, 0, READER_FRAMES);
+}
+
+/* element kernels */
+
+static void
+bench_run_fft (gpointer data)
+{
+  GstSpectrogram *self = data;
+
+  gst_spectrogram_run_fft (self, &self->channel_data[0], 0);
+  /* clear the accumulated levels like the element does after each column,
+   * so that they stay bounded */
+  gst_spectrogram_reset_message_data (self, &self->channel_data[0]);
+}
+
+typedef struct
+{
+  gfloat levels[4096];
+  gdouble sum;
+} ScaleData;
+
+static void
+bench_scale_value (gpointer data)
+{
+  ScaleData *d = data;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (d->levels); i++)
+    d->sum += scale_value (d->levels[i], -100.0);
+}
+
+static void
+bench_push_spectrum_data (gpointer data)
+{
+  gst_spectrogram_push_spectrum_data (data);
+}
+
+typedef struct
+{
+  GstSpectrogram *element;
+  guint8 *frame;
+} ComposeData;
+
+static void
+bench_compose_frame (gpointer data)
+{
+  ComposeData *d = data;
+
+  gst_spectrogram_compose_frame (d->element, d->frame);
+}
+
+/* the tools' column painters */
+
+typedef struct
+{
+  gfloat *levels;
+  guint n;
+  guint8 *surface;
+  gint stride;
+} PaintData;
+
+static void
+bench_paint_inverted (gpointer data)
+{
+  PaintData *d = data;
+
+  spectral_paint_column_inverted (d->levels, d->n, -100.0f,
+      d->surface + (d->n - 1) * d->stride, d->stride);
+}
+
+static void
+bench_paint_alpha (gpointer data)
+{
+  PaintData *d = data;
+
+  spectral_paint_column_alpha (d->levels, d->n, -100.0f,
+      d->surface + (d->n - 1) * d->stride, d->stride);
+}
+
+static void
+paint_data_init (PaintData * d, guint n)
+{
+  guint i;
+
+  d->n = n;
+  d->levels = g_new (gfloat, n);
+  for (i = 0; i < n; i++)
+    d->levels[i] = random_db ();
+  d->stride = n * 4;
+  d->surface = g_malloc0 (n * d->stride);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  ReaderData *reader = g_new (ReaderData, 1);
+  ScaleData *scale = g_new0 (ScaleData, 1);
+  PaintData paint;
+  ComposeData compose;
+  static const guint fft_bands[] = { 128, 256, 1024 };
+  static const struct
+  {
+    GstVideoFormat format;
+    const gchar *name;
+  } formats[] = {
+    {GST_VIDEO_FORMAT_GRAY8, "GRAY8"},
+    {GST_VIDEO_FORMAT_RGBx, "RGBx"}
+  };
+  guint i;
+
+  context = g_option_context_new ("- spectral kernel microbenchmarks");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return 1;
+  }
+  g_option_context_free (context);
+
+  repetitions = MAX (repetitions, 1);
+  warmup = MAX (warmup, 0);
+
+  printf ("%-32s %10s %10s %10s %10s %10s\n", "kernel (ns per call)", "min",
+      "p50", "p90", "p99", "p50/item");
+
+  for (i = 0; i < G_N_ELEMENTS (reader->in); i++)
+    reader->in[i] = g_random_int_range (-32768, 32768);
+  bench_run ("input_data_mixed_int16_max", bench_input_mixed, reader, 16,
+      READER_FRAMES);
+  bench_run ("input_data_int16_max", bench_input_single, reader, 16,
+      READER_FRAMES);
+
+  for (i = 0; i < G_N_ELEMENTS (fft_bands); i++) {
+    GstSpectrogram *element = bench_element (fft_bands[i],
+        GST_VIDEO_FORMAT_GRAY8, 320, 240);
+    gchar *name = g_strdup_printf ("run_fft, %u bands", fft_bands[i]);
+
+    bench_run (name, bench_run_fft, element, 16, element->num_bands);
+
+    g_free (name);
+    gst_object_unref (element);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (scale->levels); i++)
+    scale->levels[i] = random_db ();
+  bench_run ("scale_value", bench_scale_value, scale, 4,
+      G_N_ELEMENTS (scale->levels));
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++) {
+    gchar *name;
+
+    compose.element = bench_element (256, formats[i].format, 320, 240);
+    compose.frame = g_malloc (GST_VIDEO_INFO_SIZE (&compose.element->vinfo));
+
+    name = g_strdup_printf ("push_spectrum_data, %s", formats[i].name);
+    bench_run (name, bench_push_spectrum_data, compose.element, 16, 240);
+    g_free (name);
+
+    name = g_strdup_printf ("compose_frame 320x240, %s", formats[i].name);
+    bench_run (name, bench_compose_frame, &compose, 4, 240);
+    g_free (name);
+
+    g_free (compose.frame);
+    gst_object_unref (compose.element);
+  }
+
+  /* soundprint paints 128 bands into a 128x128 thumbnail */
+  paint_data_init (&paint, 128);
+  bench_run ("soundprint column", bench_paint_inverted, &paint, 64, paint.n);
+  g_free (paint.levels);
+  g_free (paint.surface);
+
+  /* and sonogen 200 bands into a 200 pixel high picture */
+  paint_data_init (&paint, 200);
+  bench_run ("sonogen paint_spectrum_at_offset", bench_paint_alpha, &paint,
+      64, paint.n);
+  g_free (paint.levels);
+  g_free (paint.surface);
+
+  g_free (reader);
+  g_free (scale);
+
+  return 0;
+}
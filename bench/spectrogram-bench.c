@@ -0,0 +1,215 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+/* Throughput benchmark for the spectrogram element.
+ *
+ * Runs audiotestsrc ! spectrogram ! fakesink as fast as possible over a
+ * matrix of signals, sample rates, channel counts, band counts and output
+ * sizes, and prints one JSON object per run:
+ *
+ *   {"wave": "white-noise", "rate": 44100, "channels": 2, "bands": 256,
+ *    "width": 320, "height": 240, "seconds": 10, "wall_ms": 123.4,
+ *    "realtime_factor": 81.0, "ns_per_sample": 140.0}
+ *
+ * ns_per_sample is the wall clock time per sample of every channel.  With
+ * --max-ns-per-sample the program exits with 1 when any run is slower than
+ * that, so it can guard optimizations against regressions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+static const struct
+{
+  const gchar *name;
+  gint wave;                    /* audiotestsrc's wave property */
+} waves[] = {
+  {"white-noise", 5},
+  {"sine", 0},
+  {"silence", 4}
+};
+
+static const gint rates[] = { 22050, 44100, 48000 };
+static const gint channel_counts[] = { 1, 2 };
+static const guint band_counts[] = { 128, 512 };
+
+static const struct
+{
+  gint width;
+  gint height;
+} sizes[] = {
+  {320, 240},
+  {1024, 512}
+};
+
+static gint seconds = 10;
+static gdouble max_ns_per_sample = 0.0;
+static gboolean quick = FALSE;
+static gchar *plugin_dir = NULL;
+static gchar *layout = NULL;
+
+static GOptionEntry entries[] = {
+  {"seconds", 's', 0, G_OPTION_ARG_INT, &seconds,
+      "Seconds of audio per run (default 10)", "N"},
+  {"max-ns-per-sample", 'm', 0, G_OPTION_ARG_DOUBLE, &max_ns_per_sample,
+      "Fail when a run takes longer than this per sample", "NS"},
+  {"quick", 'q', 0, G_OPTION_ARG_NONE, &quick,
+      "Only run the first entry of each dimension but the signal", NULL},
+  {"plugin-dir", 'p', 0, G_OPTION_ARG_FILENAME, &plugin_dir,
+      "Directory to load the spectrogram plugin from (default: build tree)",
+      "DIR"},
+  {"layout", 'l', 0, G_OPTION_ARG_STRING, &layout,
+      "Value of the element's layout property", "LAYOUT"},
+  {NULL}
+};
+
+/* runs one pipeline to EOS and returns the wall clock time in microseconds,
+ * or -1 on error */
+static gint64
+run_pipeline (const gchar * description)
+{
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+  gint64 start, elapsed = -1;
+
+  pipeline = gst_parse_launch (description, &error);
+  if (!pipeline) {
+    g_printerr ("could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return -1;
+  }
+
+  bus = gst_element_get_bus (pipeline);
+
+  start = g_get_monotonic_time ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS) {
+    elapsed = g_get_monotonic_time () - start;
+  } else {
+    gchar *debug = NULL;
+
+    gst_message_parse_error (msg, &error, &debug);
+    g_printerr ("error: %s\n%s\n", error->message, debug ? debug : "");
+    g_error_free (error);
+    g_free (debug);
+  }
+
+  gst_message_unref (msg);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+
+  return elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  guint w, r, c, b, z;
+  guint n_rates, n_channels, n_bands, n_sizes;
+  gboolean regressed = FALSE;
+
+  context = g_option_context_new ("- spectrogram element benchmark");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    g_error_free (error);
+    return 2;
+  }
+  g_option_context_free (context);
+
+  gst_registry_scan_path (gst_registry_get (),
+      plugin_dir ? plugin_dir : PLUGIN_DIR);
+  if (!gst_registry_check_feature_version (gst_registry_get (),
+          "spectrogram", 1, 0, 0)) {
+    g_printerr ("spectrogram element not found in %s\n",
+        plugin_dir ? plugin_dir : PLUGIN_DIR);
+    return 2;
+  }
+
+  n_rates = quick ? 1 : G_N_ELEMENTS (rates);
+  n_channels = quick ? 1 : G_N_ELEMENTS (channel_counts);
+  n_bands = quick ? 1 : G_N_ELEMENTS (band_counts);
+  n_sizes = quick ? 1 : G_N_ELEMENTS (sizes);
+
+  for (w = 0; w < G_N_ELEMENTS (waves); w++)
+    for (r = 0; r < n_rates; r++)
+      for (c = 0; c < n_channels; c++)
+        for (b = 0; b < n_bands; b++)
+          for (z = 0; z < n_sizes; z++) {
+            const gint samples_per_buffer = 1024;
+            gint rate = rates[r];
+            gint channels = channel_counts[c];
+            guint64 frames = (guint64) rate * seconds;
+            gchar *description;
+            gint64 elapsed;
+            gdouble ns_per_sample, realtime_factor;
+
+            description = g_strdup_printf ("audiotestsrc wave=%d "
+                "samplesperbuffer=%d num-buffers=%" G_GUINT64_FORMAT " ! "
+                "audio/x-raw,format=%s,rate=%d,channels=%d ! "
+                "spectrogram bands=%u%s%s ! "
+                "video/x-raw,width=%d,height=%d ! fakesink sync=false",
+                waves[w].wave, samples_per_buffer,
+                (frames + samples_per_buffer - 1) / samples_per_buffer,
+                G_BYTE_ORDER == G_LITTLE_ENDIAN ? "S16LE" : "S16BE",
+                rate, channels, band_counts[b],
+                layout ? " layout=" : "", layout ? layout : "",
+                sizes[z].width, sizes[z].height);
+
+            elapsed = run_pipeline (description);
+            g_free (description);
+            if (elapsed < 0)
+              return 2;
+
+            ns_per_sample = elapsed * 1000.0 / (frames * channels);
+            realtime_factor = seconds * 1e6 / MAX (elapsed, 1);
+
+            printf ("{\"wave\": \"%s\", \"rate\": %d, \"channels\": %d, "
+                "\"bands\": %u, \"width\": %d, \"height\": %d, "
+                "\"seconds\": %d, \"wall_ms\": %.3f, "
+                "\"realtime_factor\": %.2f, \"ns_per_sample\": %.2f}\n",
+                waves[w].name, rate, channels, band_counts[b],
+                sizes[z].width, sizes[z].height, seconds, elapsed / 1000.0,
+                realtime_factor, ns_per_sample);
+            fflush (stdout);
+
+            if (max_ns_per_sample > 0.0 && ns_per_sample > max_ns_per_sample) {
+              g_printerr ("%s at %d Hz, %d channels, %u bands, %dx%d: "
+                  "%.2f ns per sample exceeds %.2f\n", waves[w].name, rate,
+                  channels, band_counts[b], sizes[z].width, sizes[z].height,
+                  ns_per_sample, max_ns_per_sample);
+              regressed = TRUE;
+            }
+          }
+
+  return regressed ? 1 : 0;
+}
@@ -25,9 +25,78 @@
  * The Spectrogram element analyzes the frequency spectrum of an audio signal
  * and produces a visualization of that signal in the form of a 'spectrogram'
  *
- * If #GstSpectrogram:multi-channel property is set to true. magnitude and phase
- * fields will be each a nested #GstValueArray. The first dimension are the
- * channels and the second dimension are the values.
+ * With the default #GstSpectrogram:layout the channels are mixed down before
+ * the analysis. The stacked and side-by-side layouts analyze every channel
+ * and draw one spectrogram per channel, above each other or next to each
+ * other. #GstSpectrogram:multi-channel is kept as a shorthand for the stacked
+ * layout.
+ *
+ * By default an FFT is run for every window of 2 * (#GstSpectrogram:bands - 1)
+ * frames and the windows do not overlap. The window is zero-padded to the next
+ * length that only has the factors 2, 3 and 5, for which the FFT is fast.
+ * #GstSpectrogram:hop-size or #GstSpectrogram:overlap make the FFTs run more
+ * (or less) often than that, trading CPU for temporal resolution.
+ *
+ * With #GstSpectrogram:worker enabled the chain function only copies the
+ * audio into a queue and returns; the analysis and the video frames happen
+ * on a thread of the element's own, with the channels of multi-channel input
+ * spread over a small pool of threads.
+ *
+ * The output is GRAY8 when downstream accepts it, a quarter of the bandwidth
+ * of RGBx. With RGBx output the levels can be drawn with one of the
+ * #GstSpectrogram:colormap palettes.
+ *
+ * By default the picture scrolls: every frame shows the last width columns.
+ * With #GstSpectrogram:mode set to offline nothing is pushed while the audio
+ * streams. Instead every column is kept, and at EOS the whole spectrogram is
+ * pushed as one image that is as wide as the number of columns. If downstream
+ * does not accept that width, or #GstSpectrogram:offline-tiles is set, the
+ * image is pushed as a run of tiles of the negotiated width instead.
+ *
+ * A flushing seek that lands inside the columns still in the picture redraws
+ * the frame for the new position at once from those columns, so scrubbing
+ * does not have to wait for new audio to be analyzed.
+ *
+ * The #GstSpectrogram:stats property tells whether the element keeps up: the
+ * number and cost of the FFTs and of the video frames, and the bytes copied.
+ * Each thread counts on its own and adds its counts to the property about
+ * once a second, so the statistics are always collected.
+ * #GstSpectrogram:stats-interval additionally posts them as a
+ * "spectrogram-stats" element message.
+ *
+ * Applications that also need the numbers do not have to run a spectrum
+ * element next to this one. With #GstSpectrogram:attach-meta every video
+ * frame carries a #GstSpectrumMeta with the levels of the columns that were
+ * added since the previous frame. With #GstSpectrogram:post-messages the same
+ * data is posted as a "spectrogram" element message with the fields:
+ * <itemizedlist>
+ * <listitem>
+ *   <para>
+ *   #guint
+ *   <classname>&quot;bands&quot;</classname>,
+ *   <classname>&quot;channels&quot;</classname> and
+ *   <classname>&quot;columns&quot;</classname>:
+ *   the dimensions of the data.
+ *   </para>
+ * </listitem>
+ * <listitem>
+ *   <para>
+ *   #GBytes
+ *   <classname>&quot;timestamps&quot;</classname>:
+ *   the start time of each column as #GstClockTime.
+ *   </para>
+ * </listitem>
+ * <listitem>
+ *   <para>
+ *   #GBytes
+ *   <classname>&quot;magnitudes&quot;</classname>:
+ *   the levels in dB as #gfloat, laid out like in #GstSpectrumMeta.
+ *   </para>
+ * </listitem>
+ * </itemizedlist>
+ * Applications read the meta with gst_buffer_get_spectrum_meta() from
+ * <gst/spectrogram/gstspectrummeta.h>, linking the
+ * gstreamer-spectrummeta-1.0 library.
  *
  */
 
@@ -39,6 +108,9 @@
 #include <string.h>
 #include <math.h>
 #include "gstspectrogram.h"
+#include "gstspectrummeta.h"
+#include "spectral.h"
+#include <gst/audio/audio.h>
 #include <gst/video/video.h>
 
 GST_DEBUG_CATEGORY_STATIC (gst_spectrogram_debug);
@@ -52,14 +124,134 @@ GST_DEBUG_CATEGORY_STATIC (gst_spectrogram_debug);
 #define DEFAULT_BANDS			DEFAULT_HEIGHT
 #define DEFAULT_THRESHOLD		-100
 #define DEFAULT_MULTI_CHANNEL		FALSE
-#define FFT_PER_VFRAME 10
+#define DEFAULT_HOP_SIZE		0
+#define DEFAULT_OVERLAP			0.0
+#define DEFAULT_WINDOW			GST_SPECTROGRAM_WINDOW_HAMMING
+#define DEFAULT_WORKER			FALSE
+#define DEFAULT_FRAMES_DROPPED		0
+#define DEFAULT_COLORMAP		GST_SPECTROGRAM_COLORMAP_GRAYSCALE
+#define DEFAULT_LAYOUT			GST_SPECTROGRAM_LAYOUT_MIXED
+#define DEFAULT_ATTACH_META		FALSE
+#define DEFAULT_POST_MESSAGES		FALSE
+#define DEFAULT_MODE			GST_SPECTROGRAM_MODE_SCROLL
+#define DEFAULT_OFFLINE_TILES		FALSE
+#define WORKER_QUEUE_SIZE 32
+#define MAX_FFT_THREADS 4
+#define DEFAULT_FFTS_PER_FRAME		10
+#define DEFAULT_STATS_INTERVAL		0
+#define STATS_PUBLISH_PERIOD		GST_SECOND
+#define TILE_COLUMNS 256
 
 enum
 {
   PROP_0,
   PROP_BANDS,
   PROP_THRESHOLD,
-  PROP_MULTI_CHANNEL
+  PROP_MULTI_CHANNEL,
+  PROP_HOP_SIZE,
+  PROP_OVERLAP,
+  PROP_WINDOW,
+  PROP_WORKER,
+  PROP_FRAMES_DROPPED,
+  PROP_COLORMAP,
+  PROP_LAYOUT,
+  PROP_ATTACH_META,
+  PROP_POST_MESSAGES,
+  PROP_MODE,
+  PROP_OFFLINE_TILES,
+  PROP_FFTS_PER_FRAME,
+  PROP_STATS,
+  PROP_STATS_INTERVAL
+};
+
+#define GST_TYPE_SPECTROGRAM_WINDOW (gst_spectrogram_window_get_type ())
+static GType
+gst_spectrogram_window_get_type (void)
+{
+  static GType window_type = 0;
+  static const GEnumValue windows[] = {
+    {GST_SPECTROGRAM_WINDOW_HANN, "Hann", "hann"},
+    {GST_SPECTROGRAM_WINDOW_HAMMING, "Hamming", "hamming"},
+    {GST_SPECTROGRAM_WINDOW_BLACKMAN_HARRIS, "Blackman-Harris",
+        "blackman-harris"},
+    {0, NULL, NULL}
+  };
+
+  if (!window_type)
+    window_type = g_enum_register_static ("GstSpectrogramWindow", windows);
+
+  return window_type;
+}
+
+#define GST_TYPE_SPECTROGRAM_COLORMAP (gst_spectrogram_colormap_get_type ())
+static GType
+gst_spectrogram_colormap_get_type (void)
+{
+  static GType colormap_type = 0;
+  static const GEnumValue colormaps[] = {
+    {GST_SPECTROGRAM_COLORMAP_GRAYSCALE, "Grayscale", "grayscale"},
+    {GST_SPECTROGRAM_COLORMAP_INFERNO, "Inferno", "inferno"},
+    {GST_SPECTROGRAM_COLORMAP_VIRIDIS, "Viridis", "viridis"},
+    {0, NULL, NULL}
+  };
+
+  if (!colormap_type)
+    colormap_type = g_enum_register_static ("GstSpectrogramColormap",
+        colormaps);
+
+  return colormap_type;
+}
+
+#define GST_TYPE_SPECTROGRAM_LAYOUT (gst_spectrogram_layout_get_type ())
+static GType
+gst_spectrogram_layout_get_type (void)
+{
+  static GType layout_type = 0;
+  static const GEnumValue layouts[] = {
+    {GST_SPECTROGRAM_LAYOUT_MIXED, "Mix all channels into one spectrogram",
+        "mixed"},
+    {GST_SPECTROGRAM_LAYOUT_STACKED, "One spectrogram per channel, stacked",
+        "stacked"},
+    {GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE,
+        "One spectrogram per channel, side by side", "side-by-side"},
+    {0, NULL, NULL}
+  };
+
+  if (!layout_type)
+    layout_type = g_enum_register_static ("GstSpectrogramLayout", layouts);
+
+  return layout_type;
+}
+
+#define GST_TYPE_SPECTROGRAM_MODE (gst_spectrogram_mode_get_type ())
+static GType
+gst_spectrogram_mode_get_type (void)
+{
+  static GType mode_type = 0;
+  static const GEnumValue modes[] = {
+    {GST_SPECTROGRAM_MODE_SCROLL, "Scroll the last columns through each frame",
+        "scroll"},
+    {GST_SPECTROGRAM_MODE_OFFLINE, "Render the whole stream at EOS",
+        "offline"},
+    {0, NULL, NULL}
+  };
+
+  if (!mode_type)
+    mode_type = g_enum_register_static ("GstSpectrogramMode", modes);
+
+  return mode_type;
+}
+
+/* the matplotlib palettes sampled at every eighth of their range, the LUT
+ * interpolates linearly between them */
+#define COLORMAP_STOPS 9
+static const guint8 inferno_stops[COLORMAP_STOPS][3] = {
+  {0, 0, 4}, {31, 12, 72}, {85, 15, 109}, {136, 34, 106}, {186, 54, 85},
+  {227, 89, 51}, {249, 140, 10}, {249, 201, 50}, {252, 255, 164}
+};
+static const guint8 viridis_stops[COLORMAP_STOPS][3] = {
+  {68, 1, 84}, {71, 44, 122}, {59, 81, 139}, {44, 113, 142}, {33, 144, 141},
+  {39, 173, 129}, {92, 200, 99}, {170, 220, 50}, {253, 231, 37}
 };
 
 G_DEFINE_TYPE (GstSpectrogram, gst_spectrogram, GST_TYPE_ELEMENT);
@@ -68,52 +260,55 @@ static GstStaticPadTemplate src_template =
     GST_STATIC_PAD_TEMPLATE ("src",
                              GST_PAD_SRC,
                              GST_PAD_ALWAYS,
-                             GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE("RGBx")));
+                             GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE("{ GRAY8, RGBx }")));
 
 static GstStaticPadTemplate sink_template =
     GST_STATIC_PAD_TEMPLATE ("sink",
                              GST_PAD_SINK,
                              GST_PAD_ALWAYS,
-                             GST_STATIC_CAPS ("audio/x-raw-int, "
-                                              "endianness = (int) BYTE_ORDER, "
-                                              "signed = (boolean) TRUE, "
-                                              "width = (int) 16, "
-                                              "depth = (int) 16, "
+                             GST_STATIC_CAPS ("audio/x-raw, "
+                                              "format = (string) " GST_AUDIO_NE (S16) ", "
+                                              "layout = (string) interleaved, "
                                               "rate = (int) [ 8000, 96000 ], "
-                                              "channels = (int) { 1, 2 }"));
+                                              "channels = (int) [ 1, 8 ]"));
 
 static void gst_spectrogram_finalize (GObject * object);
 static void gst_spectrogram_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gst_spectrogram_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
+static GstStateChangeReturn gst_spectrogram_change_state (GstElement * element,
+    GstStateChange transition);
 
 static void
-gst_spectrogram_base_init (gpointer g_class)
+gst_spectrogram_class_init (GstSpectrogramClass * klass)
 {
-  GstElementClass *element_class = GST_ELEMENT_CLASS (g_class);
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
 
-  gst_element_class_set_details_simple (element_class, "Spectrogram",
+  gobject_class->set_property = gst_spectrogram_set_property;
+  gobject_class->get_property = gst_spectrogram_get_property;
+  gobject_class->finalize = gst_spectrogram_finalize;
+
+  element_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_spectrogram_change_state);
+
+  /* G_DEFINE_TYPE has no base_init, so this has to happen here */
+  gst_element_class_set_static_metadata (element_class, "Spectrogram",
       "Visualization",
       "Run an FFT on the audio signal, visualize spectrogram data",
       "Erik Walthinsen <omega@cse.ogi.edu>, "
       "Stefan Kost <ensonic@users.sf.net>, "
       "Sebastian Dröge <sebastian.droege@collabora.co.uk>, "
       "Jonathon Jongsma <jonathon@quotidian.org>");
-}
-
-static void
-gst_spectrogram_class_init (GstSpectrogramClass * klass)
-{
-  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
-
-  gobject_class->set_property = gst_spectrogram_set_property;
-  gobject_class->get_property = gst_spectrogram_get_property;
-  gobject_class->finalize = gst_spectrogram_finalize;
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_template));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_template));
 
   g_object_class_install_property (gobject_class, PROP_BANDS,
       g_param_spec_uint ("bands", "Bands", "Number of frequency bands",
-          0, G_MAXUINT, DEFAULT_BANDS,
+          2, G_MAXUINT / 2, DEFAULT_BANDS,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   g_object_class_install_property (gobject_class, PROP_THRESHOLD,
@@ -124,68 +319,384 @@ gst_spectrogram_class_init (GstSpectrogramClass * klass)
 
   g_object_class_install_property (gobject_class, PROP_MULTI_CHANNEL,
       g_param_spec_boolean ("multi-channel", "Multichannel results",
-          "Send separate results for each channel",
+          "Analyze and show each channel separately (same as the stacked "
+          "layout)",
           DEFAULT_MULTI_CHANNEL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_HOP_SIZE,
+      g_param_spec_uint ("hop-size", "Hop size",
+          "Number of frames between the starts of consecutive FFT windows "
+          "(0 = derive from overlap)",
+          0, G_MAXUINT, DEFAULT_HOP_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OVERLAP,
+      g_param_spec_double ("overlap", "Overlap",
+          "Fraction of the FFT window shared by consecutive FFTs, used when "
+          "hop-size is 0",
+          0.0, 0.99, DEFAULT_OVERLAP,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WINDOW,
+      g_param_spec_enum ("window", "Window",
+          "Window function applied to the signal before the FFT",
+          GST_TYPE_SPECTROGRAM_WINDOW, DEFAULT_WINDOW,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WORKER,
+      g_param_spec_boolean ("worker", "Worker thread",
+          "Run the analysis and push video frames from a separate thread "
+          "instead of the upstream streaming thread",
+          DEFAULT_WORKER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_FRAMES_DROPPED,
+      g_param_spec_uint64 ("frames-dropped", "Frames dropped",
+          "Number of video frames not rendered because they would have "
+          "arrived late downstream",
+          0, G_MAXUINT64, DEFAULT_FRAMES_DROPPED,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_COLORMAP,
+      g_param_spec_enum ("colormap", "Colormap",
+          "Palette used for the levels when the output is RGB",
+          GST_TYPE_SPECTROGRAM_COLORMAP, DEFAULT_COLORMAP,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LAYOUT,
+      g_param_spec_enum ("layout", "Layout",
+          "How the channels are analyzed and laid out in the picture",
+          GST_TYPE_SPECTROGRAM_LAYOUT, DEFAULT_LAYOUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ATTACH_META,
+      g_param_spec_boolean ("attach-meta", "Attach meta",
+          "Attach the levels drawn since the previous frame to each video "
+          "frame as GstSpectrumMeta",
+          DEFAULT_ATTACH_META, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_POST_MESSAGES,
+      g_param_spec_boolean ("post-messages", "Post messages",
+          "Post the levels drawn since the previous frame as an element "
+          "message",
+          DEFAULT_POST_MESSAGES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MODE,
+      g_param_spec_enum ("mode", "Mode",
+          "Scroll through the stream, or render all of it at EOS",
+          GST_TYPE_SPECTROGRAM_MODE, DEFAULT_MODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_OFFLINE_TILES,
+      g_param_spec_boolean ("offline-tiles", "Offline tiles",
+          "In offline mode, push the image as tiles of the negotiated width "
+          "instead of renegotiating to the full width",
+          DEFAULT_OFFLINE_TILES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_FFTS_PER_FRAME,
+      g_param_spec_uint ("ffts-per-frame", "FFTs per frame",
+          "Number of columns added to the picture per video frame",
+          1, 1000, DEFAULT_FFTS_PER_FRAME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Throughput statistics, updated about once a second",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint64 ("stats-interval", "Statistics interval",
+          "Interval in nanoseconds between statistics messages (0 = none)",
+          0, G_MAXUINT64, DEFAULT_STATS_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   GST_DEBUG_CATEGORY_INIT (gst_spectrogram_debug, "spectrogram", 0,
       "spectrogram visualization element");
 }
 
 static gboolean
 gst_spectrogram_setup (GstSpectrogram * self);
+static void gst_spectrogram_drain_worker (GstSpectrogram * self);
+static void gst_spectrogram_unblock_worker (GstSpectrogram * self);
+static void gst_spectrogram_restart_worker (GstSpectrogram * self);
+static void gst_spectrogram_free_history (GstSpectrogram * self);
+static void gst_spectrogram_flush_analysis (GstSpectrogram * self);
+static void gst_spectrogram_redraw_at (GstSpectrogram * self,
+    GstClockTime position);
+static GstFlowReturn gst_spectrogram_push_offline (GstSpectrogram * self);
+static guint gst_spectrogram_calculate_hop (GstSpectrogram * self,
+    guint window_len);
+static void gst_spectrogram_flush_stats (GstSpectrogram * self);
+static gboolean gst_spectrogram_negotiate (GstSpectrogram * self);
+static void gst_spectrogram_configure_interval (GstSpectrogram * self);
 
 static gboolean
 gst_spectrogram_sink_event (GstPad *pad, GstObject *parent, GstEvent *event)
 {
   gboolean res = FALSE;
   GstSpectrogram *self = GST_SPECTROGRAM (parent);
-  if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
-		GstStructure *structure;
-    GstCaps *caps;
 
-		gst_event_parse_caps(event, &caps);
-		structure = gst_caps_get_structure (caps, 0);
+  /* the frames of the queued audio have to go out before anything that is
+   * serialized after it, and the worker must be done with the channel data
+   * and the history before they are touched below.  FLUSH_STOP drops the
+   * queue instead */
+  if (GST_EVENT_IS_SERIALIZED (event) &&
+      GST_EVENT_TYPE (event) != GST_EVENT_FLUSH_STOP)
+    gst_spectrogram_drain_worker (self);
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:{
+      GstStructure *structure;
+      GstCaps *caps;
+
+      gst_event_parse_caps (event, &caps);
+      structure = gst_caps_get_structure (caps, 0);
+
+      res = gst_structure_get_int (structure, "channels",
+          &self->format_channels);
+      res &= gst_structure_get_int (structure, "rate", &self->rate);
+      self->bps = self->format_channels * sizeof (gint16);
+
+      res &= gst_spectrogram_setup (self);
+
+      /* the video caps have to be set before the segment goes downstream */
+      if (res && !gst_pad_has_current_caps (self->srcpad))
+        res = gst_spectrogram_negotiate (self);
+      gst_event_unref (event);
+      break;
+    }
+    case GST_EVENT_SEGMENT:
+      /* needed to turn timestamps into running time for QoS */
+      gst_event_copy_segment (event, &self->segment);
+      res = gst_pad_push_event (self->srcpad, event);
+
+      if (self->redraw_pending) {
+        self->redraw_pending = FALSE;
+        if (self->segment.format == GST_FORMAT_TIME)
+          gst_spectrogram_redraw_at (self, self->segment.start);
+        else
+          gst_spectrogram_free_history (self);
+      }
+      break;
+    case GST_EVENT_FLUSH_START:
+      /* downstream unblocks a worker stuck in a push, we unblock the
+       * chain function and a worker waiting on the ring */
+      res = gst_pad_push_event (self->srcpad, event);
+      if (self->worker_running)
+        gst_spectrogram_unblock_worker (self);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_spectrogram_restart_worker (self);
 
-		res = gst_structure_get_int (structure, "channels", &self->format_channels);
-		res &= gst_structure_get_int (structure, "rate", &self->rate);
-		self->bps = self->format_channels * sizeof (gint16);
+      /* the columns are kept until the new segment tells where we are */
+      gst_spectrogram_flush_analysis (self);
+      if (self->mode == GST_SPECTROGRAM_MODE_OFFLINE)
+        gst_spectrogram_free_history (self);
+      gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+      self->redraw_pending = TRUE;
 
-		res &= gst_spectrogram_setup (self);
+      res = gst_pad_push_event (self->srcpad, event);
+      break;
+    case GST_EVENT_EOS:
+      if (self->mode == GST_SPECTROGRAM_MODE_OFFLINE &&
+          gst_spectrogram_push_offline (self) < GST_FLOW_EOS)
+        GST_WARNING_OBJECT (self, "failed to push the offline image");
+
+      /* the worker is drained, so the counts are complete */
+      gst_spectrogram_flush_stats (self);
+      res = gst_pad_push_event (self->srcpad, event);
+      break;
+    default:
+      res = gst_pad_event_default (pad, parent, event);
+      break;
   }
 
   return res;
 }
 
+static void gst_spectrogram_update_lut (GstSpectrogram * self);
+static void gst_spectrogram_flush (GstSpectrogram * self);
+static void gst_spectrogram_resize_history (GstSpectrogram * self,
+    gint height);
+
+static gboolean
+gst_spectrogram_src_setcaps (GstSpectrogram * self, GstCaps * caps)
+{
+  GstVideoInfo info;
+  GstClockTime old_interval = self->interval;
+
+  if (!gst_video_info_from_caps (&info, caps) || GST_VIDEO_INFO_FPS_N (&info) <= 0)
+    return FALSE;
+
+  GST_DEBUG_OBJECT (self, "src caps: %" GST_PTR_FORMAT, caps);
+
+  /* the cached columns are already shaded for the old format, but can be
+   * stretched to a new height */
+  if (GST_VIDEO_INFO_FORMAT (&info) != GST_VIDEO_INFO_FORMAT (&self->vinfo))
+    gst_spectrogram_flush (self);
+  else if (GST_VIDEO_INFO_HEIGHT (&info) != GST_VIDEO_INFO_HEIGHT (&self->vinfo))
+    gst_spectrogram_resize_history (self, GST_VIDEO_INFO_HEIGHT (&info));
+
+  self->vinfo = info;
+  self->width = GST_VIDEO_INFO_WIDTH (&info);
+  self->height = GST_VIDEO_INFO_HEIGHT (&info);
+  self->fps_n = GST_VIDEO_INFO_FPS_N (&info);
+  self->fps_d = GST_VIDEO_INFO_FPS_D (&info);
+  self->bpp = GST_VIDEO_INFO_COMP_PSTRIDE (&info, 0);
+
+  gst_spectrogram_update_lut (self);
+
+  self->interval = gst_util_uint64_scale_int (GST_SECOND, self->fps_d,
+      self->ffts_per_frame * self->fps_n);
+  self->frame_duration = gst_util_uint64_scale_int (GST_SECOND, self->fps_d,
+      self->fps_n);
+
+  /* on a renegotiation the columns get a new length, so the one in
+   * progress is dropped; the picture is kept */
+  if (self->channel_data && self->interval != old_interval) {
+    gst_spectrogram_flush_analysis (self);
+    gst_spectrogram_configure_interval (self);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_spectrogram_src_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  GstSpectrogram *self = GST_SPECTROGRAM (parent);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_LATENCY:{
+      GstClockTime min, max, latency;
+      gboolean live;
+      guint window_len, hop;
+
+      if (!gst_pad_peer_query (self->sinkpad, query))
+        return FALSE;
+
+      if (self->rate <= 0 || !GST_CLOCK_TIME_IS_VALID (self->frame_duration))
+        return TRUE;
+
+      /* a frame can only go out once the audio of its last column has
+       * arrived, and the window of that column reaches past its hop.  Before
+       * the first buffer, the window is the one the bands will give. */
+      window_len = self->window_len ? self->window_len : 2 * self->bands - 2;
+      hop = gst_spectrogram_calculate_hop (self, window_len);
+      latency = self->frame_duration;
+      if (window_len > hop)
+        latency += gst_util_uint64_scale_int (window_len - hop, GST_SECOND,
+            self->rate);
+
+      gst_query_parse_latency (query, &live, &min, &max);
+      min += latency;
+      if (GST_CLOCK_TIME_IS_VALID (max))
+        max += latency;
+      gst_query_set_latency (query, live, min, max);
+
+      GST_DEBUG_OBJECT (self, "latency %" GST_TIME_FORMAT ", min %"
+          GST_TIME_FORMAT, GST_TIME_ARGS (latency), GST_TIME_ARGS (min));
+      return TRUE;
+    }
+    default:
+      return gst_pad_query_default (pad, parent, query);
+  }
+}
+
 static gboolean
 gst_spectrogram_src_event (GstPad *pad, GstObject *parent, GstEvent *event)
 {
-  gboolean res = FALSE;
   GstSpectrogram *self = GST_SPECTROGRAM (parent);
 
-	if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
-		GstStructure *structure;
-		GstCaps *caps;
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_QOS:{
+      gdouble proportion;
+      GstClockTimeDiff diff;
+      GstClockTime timestamp;
+
+      gst_event_parse_qos (event, NULL, &proportion, &diff, &timestamp);
+
+      GST_OBJECT_LOCK (self);
+      if (diff >= 0)
+        /* we're late, skip ahead to the next frame we expect to be on time */
+        self->earliest_time = timestamp + 2 * diff + self->frame_duration;
+      else
+        self->earliest_time = timestamp + diff;
+      GST_OBJECT_UNLOCK (self);
 
-		gst_event_parse_caps(event, &caps);
-		structure = gst_caps_get_structure (caps, 0);
+      GST_LOG_OBJECT (self, "qos: proportion %g, diff %" G_GINT64_FORMAT
+          ", earliest time %" GST_TIME_FORMAT, proportion, diff,
+          GST_TIME_ARGS (self->earliest_time));
+
+      return gst_pad_push_event (self->sinkpad, event);
+    }
+    default:
+      return gst_pad_event_default (pad, parent, event);
+  }
+}
 
-		res = gst_structure_get_int (structure, "width", &self->width);
-		res &= gst_structure_get_int (structure, "height", &self->height);
-		res &= gst_structure_get_fraction (structure, "framerate", &self->fps_n,
-				&self->fps_d);
-		gchar *caps_str = gst_caps_to_string (caps);
-		g_debug ("Got src caps: %s", caps_str);
-		g_free (caps_str);
+/* picks the video caps with the peer and sets them on the src pad */
+static gboolean
+gst_spectrogram_negotiate (GstSpectrogram * self)
+{
+  GstCaps *target, *current;
+  GstCaps *tmpl = gst_pad_get_pad_template_caps (self->srcpad);
+  GstCaps *peercaps = gst_pad_peer_query_caps (self->srcpad, NULL);
+  GstStructure *structure;
+  gboolean res;
+
+  GST_DEBUG_OBJECT (self, "Trying to negotiate src pad");
+
+  /* try to negotiate caps with peer */
+  if (peercaps) {
+    target = gst_caps_intersect (peercaps, tmpl);
+    gst_caps_unref (peercaps);
+
+    if (gst_caps_is_empty (target)) {
+      gst_caps_unref (target);
+      gst_caps_unref (tmpl);
+      return FALSE;
+    }
 
-		self->interval = gst_util_uint64_scale_int (GST_SECOND, self->fps_d,
-				FFT_PER_VFRAME * self->fps_n);
+    target = gst_caps_truncate (target);
+  } else {
+    target = gst_caps_copy (tmpl);
+  }
+  gst_caps_unref (tmpl);
+
+  /* a renegotiation keeps the current picture if downstream still takes it */
+  structure = gst_caps_get_structure (target, 0);
+  gst_structure_fixate_field_nearest_int (structure, "width",
+      self->width ? self->width : DEFAULT_WIDTH);
+  gst_structure_fixate_field_nearest_int (structure, "height",
+      self->height ? self->height : DEFAULT_HEIGHT);
+  gst_structure_fixate_field_nearest_fraction (structure, "framerate",
+      self->fps_n ? self->fps_n : 25, self->fps_n ? self->fps_d : 1);
+  /* a grayscale picture is a quarter of the size in GRAY8 */
+  gst_structure_fixate_field_string (structure, "format",
+      self->colormap == GST_SPECTROGRAM_COLORMAP_GRAYSCALE ?
+      "GRAY8" : "RGBx");
+
+  current = gst_pad_get_current_caps (self->srcpad);
+  if (current && gst_caps_is_equal (current, target))
+    res = TRUE;
+  else
+    res = gst_pad_set_caps (self->srcpad, target) &&
+        gst_spectrogram_src_setcaps (self, target);
+  if (current)
+    gst_caps_unref (current);
+  gst_caps_unref (target);
 
-	}
   return res;
 }
 
 static GstFlowReturn
 gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer);
+static void gst_spectrogram_start_worker (GstSpectrogram * self);
+static GstFlowReturn
+gst_spectrogram_queue_buffer (GstSpectrogram * self, GstBuffer * buffer);
 
 static GstFlowReturn
 gst_spectrogram_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
@@ -198,40 +709,27 @@ gst_spectrogram_chain (GstPad *pad, GstObject *parent, GstBuffer *buffer)
     goto evacuate;
   }
 
-  if (gst_pad_get_current_caps (self->srcpad) == NULL)
-  {
-    GST_DEBUG_OBJECT (self, "Trying to negotiate src pad");
-
-    /* try to negotiate caps with peer */
-    GstCaps *target;
-    GstCaps *tmpl = gst_pad_get_pad_template_caps (self->srcpad);
-    GstCaps *peercaps = gst_pad_peer_query_caps (self->srcpad, NULL);
-
-    if (peercaps) {
-      target = gst_caps_intersect (peercaps, tmpl);
-      gst_caps_unref (peercaps);
-
-      if (gst_caps_is_empty (target)) {
-        gst_caps_unref (target);
+  /* downstream may ask for another size at any time.  The worker draws
+   * the queued audio with the old one first */
+  if (gst_pad_check_reconfigure (self->srcpad) ||
+      !gst_pad_has_current_caps (self->srcpad)) {
+    gst_spectrogram_drain_worker (self);
+    if (!gst_spectrogram_negotiate (self)) {
+      gst_pad_mark_reconfigure (self->srcpad);
+      if (!gst_pad_has_current_caps (self->srcpad)) {
         ret = GST_FLOW_NOT_NEGOTIATED;
         goto evacuate;
       }
-
-      gst_caps_truncate (target);
-    } else {
-      target = gst_caps_ref ((GstCaps*)tmpl);
     }
-
-    GstStructure *structure = gst_caps_get_structure (target, 0);
-    gst_structure_fixate_field_nearest_int (structure, "width", DEFAULT_WIDTH);
-    gst_structure_fixate_field_nearest_int (structure, "height", DEFAULT_HEIGHT);
-    gst_structure_fixate_field_nearest_fraction (structure, "framerate", 25, 1);
-
-    gst_pad_set_caps (self->srcpad, target);
-    gst_caps_unref (target);
   }
 
-  ret = gst_spectrogram_process_buffer (self, buffer);
+  if (self->worker && !self->worker_running)
+    gst_spectrogram_start_worker (self);
+
+  if (self->worker_running)
+    ret = gst_spectrogram_queue_buffer (self, buffer);
+  else
+    ret = gst_spectrogram_process_buffer (self, buffer);
 
 evacuate:
   gst_buffer_unref (buffer);
@@ -243,6 +741,20 @@ gst_spectrogram_init (GstSpectrogram *self)
 {
   self->bands = DEFAULT_BANDS;
   self->threshold = DEFAULT_THRESHOLD;
+  self->hop_size = DEFAULT_HOP_SIZE;
+  self->overlap = DEFAULT_OVERLAP;
+  self->window = DEFAULT_WINDOW;
+  self->worker = DEFAULT_WORKER;
+  self->colormap = DEFAULT_COLORMAP;
+  self->layout = DEFAULT_LAYOUT;
+  self->active_layout = DEFAULT_LAYOUT;
+  self->attach_meta = DEFAULT_ATTACH_META;
+  self->post_messages = DEFAULT_POST_MESSAGES;
+  self->mode = DEFAULT_MODE;
+  self->offline_tiles = DEFAULT_OFFLINE_TILES;
+  self->ffts_per_frame = DEFAULT_FFTS_PER_FRAME;
+  self->stats_interval = DEFAULT_STATS_INTERVAL;
+  gst_video_info_init (&self->vinfo);
 
   self->sinkpad = gst_pad_new_from_static_template (&sink_template, "sink");
   gst_pad_set_chain_function (self->sinkpad,
@@ -254,37 +766,179 @@ gst_spectrogram_init (GstSpectrogram *self)
   self->srcpad = gst_pad_new_from_static_template (&src_template, "src");
   gst_pad_set_event_function (self->srcpad,
                                 GST_DEBUG_FUNCPTR (gst_spectrogram_src_event));
+  gst_pad_set_query_function (self->srcpad,
+                              GST_DEBUG_FUNCPTR (gst_spectrogram_src_query));
   gst_element_add_pad (GST_ELEMENT (self), self->srcpad);
 
   self->spectrogram_data = g_queue_new ();
+  self->pending_timestamps = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+  self->pending_levels = g_array_new (FALSE, FALSE, sizeof (gfloat));
+  self->column_ts = GST_CLOCK_TIME_NONE;
+  self->base_ts = GST_CLOCK_TIME_NONE;
+  self->tiles = g_ptr_array_new_with_free_func (g_free);
+  self->tile_timestamps = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+
+  gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+  self->earliest_time = GST_CLOCK_TIME_NONE;
+
+  g_mutex_init (&self->queue_lock);
+  g_cond_init (&self->queue_cond);
+  g_mutex_init (&self->fft_lock);
+  g_cond_init (&self->fft_cond);
+}
+
+static void gst_spectrogram_fft_task (gpointer data, gpointer user_data);
+
+/* smallest even length >= len that only has the factors 2, 3 and 5 */
+static guint
+gst_spectrogram_fast_fft_length (guint len)
+{
+  guint nfft = gst_fft_next_fast_length (len);
+
+  while (nfft & 1)
+    nfft = gst_fft_next_fast_length (nfft + 1);
+
+  return nfft;
 }
 
 static void
-gst_spectrogram_alloc_channel_data (GstSpectrogram * self)
+gst_spectrogram_fill_window_table (GstSpectrogram * self)
 {
-  gint i;
-  GstSpectrumChannel *cd;
+  guint i;
+  guint len = self->window_len;
+  gfloat *table = self->window_table;
+
+  /* same (periodic) definitions as gst_fft_f32_window() */
+  for (i = 0; i < len; i++) {
+    gdouble phase = 2.0 * G_PI * i / len;
+
+    switch (self->window) {
+      case GST_SPECTROGRAM_WINDOW_HANN:
+        table[i] = 0.5 - 0.5 * cos (phase);
+        break;
+      case GST_SPECTROGRAM_WINDOW_BLACKMAN_HARRIS:
+        table[i] = 0.35875 - 0.48829 * cos (phase) +
+            0.14128 * cos (2.0 * phase) - 0.01168 * cos (3.0 * phase);
+        break;
+      case GST_SPECTROGRAM_WINDOW_HAMMING:
+      default:
+        table[i] = 0.53836 - 0.46164 * cos (phase);
+        break;
+    }
+  }
+
+  self->window_type = self->window;
+}
+
+/* the FFT context for nfft, from the few this channel used last.  Switching
+ * back and forth between band counts does not allocate again */
+static GstFFTF32 *
+gst_spectrogram_channel_fft (GstSpectrumChannel * cd, guint nfft)
+{
+  guint i;
+
+  for (i = 0; i < GST_SPECTROGRAM_FFT_CACHE_SIZE; i++) {
+    if (cd->fft_cache[i] && cd->fft_cache_nfft[i] == nfft)
+      return cd->fft_cache[i];
+  }
+
+  i = cd->fft_cache_next;
+  cd->fft_cache_next = (i + 1) % GST_SPECTROGRAM_FFT_CACHE_SIZE;
+  if (cd->fft_cache[i])
+    gst_fft_f32_free (cd->fft_cache[i]);
+  cd->fft_cache[i] = gst_fft_f32_new (nfft, FALSE);
+  cd->fft_cache_nfft[i] = nfft;
+
+  return cd->fft_cache[i];
+}
+
+/* (re)sizes everything that depends on the number of bands.  The sample
+ * rings keep their most recent samples, so a change of bands while playing
+ * does not start from silence */
+static void
+gst_spectrogram_configure_bands (GstSpectrogram * self)
+{
+  guint i, c;
   guint bands = self->bands;
-  guint nfft = 2 * bands - 2;
+  guint len = 2 * bands - 2;
+  guint nfft = gst_spectrogram_fast_fft_length (len);
+  guint old_len = self->window_len;
+  guint keep = MIN (old_len, len);
+
+  self->window_len = len;
+  self->nfft = nfft;
+  self->window_table = g_renew (gfloat, self->window_table, len);
+  gst_spectrogram_fill_window_table (self);
+
+  /* with zero-padding the bins are closer together than the bands, so pick
+   * the bin nearest to each band's center frequency */
+  g_free (self->band_bins);
+  self->band_bins = NULL;
+  if (nfft != len) {
+    self->band_bins = g_new (guint, bands);
+    for (i = 0; i < bands; i++)
+      self->band_bins[i] = ((guint64) i * nfft + len / 2) / len;
+  }
 
-  g_assert (self->channel_data == NULL);
+  GST_DEBUG_OBJECT (self, "window of %u frames, fft length %u", len, nfft);
 
-  self->num_channels = (self->multi_channel) ?
-    self->format_channels : 1;
+  for (c = 0; c < self->num_channels; c++) {
+    GstSpectrumChannel *cd = &self->channel_data[c];
+    gfloat *input = g_new0 (gfloat, len);
 
-  GST_DEBUG_OBJECT (self, "allocating data for %d channels",
-      self->num_channels);
+    /* oldest kept sample first, input_pos is the oldest of the old ring */
+    for (i = 0; i < keep; i++)
+      input[i] = cd->input[(self->input_pos + old_len - keep + i) % old_len];
+    g_free (cd->input);
+    cd->input = input;
 
-  self->channel_data = g_new (GstSpectrumChannel, self->num_channels);
-  for (i = 0; i < self->num_channels; i++) {
-    cd = &self->channel_data[i];
-    cd->fft_ctx = gst_fft_f32_new (nfft, FALSE);
-    cd->input = g_new0 (gfloat, nfft);
+    cd->fft_ctx = gst_spectrogram_channel_fft (cd, nfft);
+    g_free (cd->input_tmp);
     cd->input_tmp = g_new0 (gfloat, nfft);
-    cd->freqdata = g_new0 (GstFFTF32Complex, bands);
+    g_free (cd->freqdata);
+    cd->freqdata = g_new0 (GstFFTF32Complex, nfft / 2 + 1);
+    g_free (cd->spect_magnitude);
     cd->spect_magnitude = g_new0 (gfloat, bands);
+    g_free (cd->spect_phase);
     cd->spect_phase = g_new0 (gfloat, bands);
   }
+
+  self->input_pos = keep % len;
+  self->num_bands = bands;
+}
+
+static void
+gst_spectrogram_alloc_channel_data (GstSpectrogram * self)
+{
+  g_assert (self->channel_data == NULL);
+
+  /* only channels that end up in the picture are analyzed */
+  self->active_layout = self->layout;
+  if (self->active_layout == GST_SPECTROGRAM_LAYOUT_MIXED) {
+    self->num_channels = 1;
+    self->input_data = input_data_mixed_int16_max;
+  } else {
+    self->num_channels = self->format_channels;
+    self->input_data = input_data_int16_max;
+  }
+
+  GST_DEBUG_OBJECT (self, "allocating data for %d channels",
+      self->num_channels);
+
+  self->channel_data = g_new0 (GstSpectrumChannel, self->num_channels);
+  self->window_len = 0;
+  self->input_pos = 0;
+  gst_spectrogram_configure_bands (self);
+
+  /* the calling thread takes one of the channels itself */
+  if (self->worker && self->num_channels > 1) {
+    gint n_threads = MIN (self->num_channels - 1, MAX_FFT_THREADS);
+
+    n_threads = MIN (n_threads, (gint) g_get_num_processors () - 1);
+    if (n_threads > 0)
+      self->fft_pool = g_thread_pool_new (gst_spectrogram_fft_task, self,
+          n_threads, FALSE, NULL);
+  }
 }
 
 static void
@@ -297,10 +951,19 @@ gst_spectrogram_free_channel_data (GstSpectrogram * self)
     GST_DEBUG_OBJECT (self, "freeing data for %d channels",
         self->num_channels);
 
+    if (self->fft_pool) {
+      g_thread_pool_free (self->fft_pool, FALSE, TRUE);
+      self->fft_pool = NULL;
+    }
+
     for (i = 0; i < self->num_channels; i++) {
+      guint j;
+
       cd = &self->channel_data[i];
-      if (cd->fft_ctx)
-        gst_fft_f32_free (cd->fft_ctx);
+      for (j = 0; j < GST_SPECTROGRAM_FFT_CACHE_SIZE; j++) {
+        if (cd->fft_cache[j])
+          gst_fft_f32_free (cd->fft_cache[j]);
+      }
       g_free (cd->input);
       g_free (cd->input_tmp);
       g_free (cd->freqdata);
@@ -310,19 +973,140 @@ gst_spectrogram_free_channel_data (GstSpectrogram * self)
     g_free (self->channel_data);
     self->channel_data = NULL;
   }
+
+  g_free (self->window_table);
+  self->window_table = NULL;
+  g_free (self->band_bins);
+  self->band_bins = NULL;
+  self->window_len = 0;
+  self->num_bands = 0;
 }
 
 static void
-gst_spectrogram_flush (GstSpectrogram * self)
+gst_spectrogram_free_history (GstSpectrogram * self)
+{
+  while (!g_queue_is_empty (self->spectrogram_data)) {
+    GstSpectrogramColumn *column = g_queue_pop_tail (self->spectrogram_data);
+    g_free (column);
+  }
+
+  g_ptr_array_set_size (self->tiles, 0);
+  g_array_set_size (self->tile_timestamps, 0);
+  self->tile_columns = 0;
+}
+
+/* number of columns of the picture that one analyzed column fills */
+static guint
+gst_spectrogram_panels (GstSpectrogram * self)
+{
+  if (self->active_layout == GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE)
+    return self->num_channels;
+
+  return 1;
+}
+
+/* scales one column slice of panels to a new height, nearest neighbour */
+static void
+gst_spectrogram_resize_slice (const guint8 * src, guint8 * dest, guint panels,
+    gint old_height, gint height, guint bpp)
+{
+  guint p;
+  gint i;
+
+  for (p = 0; p < panels; p++) {
+    const guint8 *s = src + p * old_height * bpp;
+    guint8 *d = dest + p * height * bpp;
+
+    for (i = 0; i < height; i++)
+      memcpy (d + i * bpp, s + ((gint64) i * old_height / height) * bpp, bpp);
+  }
+}
+
+/* keeps the picture when only the output height changes */
+static void
+gst_spectrogram_resize_history (GstSpectrogram * self, gint height)
+{
+  guint bpp = self->bpp;
+  guint panels = gst_spectrogram_panels (self);
+  gsize old_size = self->height * bpp * panels;
+  gsize size = height * bpp * panels;
+  GList *l;
+  guint t;
+
+  if (self->height <= 0 || height <= 0) {
+    gst_spectrogram_free_history (self);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "resizing history from %d to %d rows",
+      self->height, height);
+
+  for (l = self->spectrogram_data->head; l; l = l->next) {
+    GstSpectrogramColumn *old = l->data;
+    GstSpectrogramColumn *column = g_malloc (sizeof (*column) + size);
+
+    column->timestamp = old->timestamp;
+    column->pixels = (guint8 *) (column + 1);
+    gst_spectrogram_resize_slice (old->pixels, column->pixels, panels,
+        self->height, height, bpp);
+    g_free (old);
+    l->data = column;
+  }
+
+  for (t = 0; t < self->tiles->len; t++) {
+    const guint8 *old = g_ptr_array_index (self->tiles, t);
+    guint8 *tile = g_malloc (TILE_COLUMNS * size);
+    guint i;
+
+    for (i = 0; i < TILE_COLUMNS; i++)
+      gst_spectrogram_resize_slice (old + i * old_size, tile + i * size,
+          panels, self->height, height, bpp);
+    g_ptr_array_index (self->tiles, t) = tile;
+    g_free ((gpointer) old);
+  }
+}
+
+/* forgets the audio that is not analyzed yet, but keeps the picture */
+static void
+gst_spectrogram_flush_analysis (GstSpectrogram * self)
 {
+  guint c;
+
   self->num_frames = 0;
   self->num_fft = 0;
+  self->hop_frames = 0;
+  self->video_count = 0;
+  self->input_pos = 0;
 
-  self->accumulated_error = 0;
-  while (!g_queue_is_empty (self->spectrogram_data)) {
-    gpointer slice = g_queue_pop_tail (self->spectrogram_data);
-    g_free (slice);
+  if (self->channel_data) {
+    for (c = 0; c < self->num_channels; c++) {
+      GstSpectrumChannel *cd = &self->channel_data[c];
+
+      memset (cd->input, 0, self->window_len * sizeof (gfloat));
+      memset (cd->spect_magnitude, 0, self->num_bands * sizeof (gfloat));
+      memset (cd->spect_phase, 0, self->num_bands * sizeof (gfloat));
+    }
   }
+
+  GST_OBJECT_LOCK (self);
+  self->earliest_time = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_UNLOCK (self);
+
+  self->accumulated_error = 0;
+
+  /* restart the sample clock on the next timestamp */
+  self->base_ts = GST_CLOCK_TIME_NONE;
+  self->sample_offset = 0;
+  self->column_ts = GST_CLOCK_TIME_NONE;
+  g_array_set_size (self->pending_timestamps, 0);
+  g_array_set_size (self->pending_levels, 0);
+}
+
+static void
+gst_spectrogram_flush (GstSpectrogram * self)
+{
+  gst_spectrogram_flush_analysis (self);
+  gst_spectrogram_free_history (self);
 }
 
 static void
@@ -341,10 +1125,150 @@ gst_spectrogram_finalize (GObject * object)
 
   gst_spectrogram_reset_state (self);
   g_queue_free (self->spectrogram_data);
+  g_array_free (self->pending_timestamps, TRUE);
+  g_array_free (self->pending_levels, TRUE);
+  g_ptr_array_free (self->tiles, TRUE);
+  g_array_free (self->tile_timestamps, TRUE);
+
+  g_mutex_clear (&self->queue_lock);
+  g_cond_clear (&self->queue_cond);
+  g_mutex_clear (&self->fft_lock);
+  g_cond_clear (&self->fft_cond);
 
   G_OBJECT_CLASS (gst_spectrogram_parent_class)->finalize (object);
 }
 
+/* statistics */
+
+static void
+gst_spectrogram_stats_add (GstSpectrogramStats * total,
+    const GstSpectrogramStats * stats)
+{
+  total->ffts += stats->ffts;
+  total->fft_time += stats->fft_time;
+  total->fft_max = MAX (total->fft_max, stats->fft_max);
+  total->frames += stats->frames;
+  total->push_time += stats->push_time;
+  total->push_max = MAX (total->push_max, stats->push_max);
+  total->bytes += stats->bytes;
+}
+
+/* called with the object lock */
+static GstStructure *
+gst_spectrogram_stats_structure (GstSpectrogram * self)
+{
+  const GstSpectrogramStats *stats = &self->stats;
+
+  return gst_structure_new ("spectrogram-stats",
+      "ffts", G_TYPE_UINT64, stats->ffts,
+      "ffts-per-second", G_TYPE_DOUBLE, self->ffts_per_second,
+      "fft-avg-ns", G_TYPE_UINT64,
+      stats->ffts ? stats->fft_time / stats->ffts : (guint64) 0,
+      "fft-max-ns", G_TYPE_UINT64, stats->fft_max,
+      "frames-pushed", G_TYPE_UINT64, stats->frames,
+      "frames-dropped", G_TYPE_UINT64, self->frames_dropped,
+      "push-avg-ns", G_TYPE_UINT64,
+      stats->frames ? stats->push_time / stats->frames : (guint64) 0,
+      "push-max-ns", G_TYPE_UINT64, stats->push_max,
+      "bytes-copied", G_TYPE_UINT64, stats->bytes, NULL);
+}
+
+static void
+gst_spectrogram_reset_stats (GstSpectrogram * self)
+{
+  guint c;
+
+  memset (&self->analysis_stats, 0, sizeof (GstSpectrogramStats));
+  memset (&self->chain_stats, 0, sizeof (GstSpectrogramStats));
+  self->analysis_published = self->chain_published = gst_util_get_timestamp ();
+
+  if (self->channel_data) {
+    for (c = 0; c < self->num_channels; c++)
+      memset (&self->channel_data[c].stats, 0, sizeof (GstSpectrogramStats));
+  }
+
+  GST_OBJECT_LOCK (self);
+  memset (&self->stats, 0, sizeof (GstSpectrogramStats));
+  self->ffts_per_second = 0.0;
+  self->stats_posted = self->analysis_published;
+  GST_OBJECT_UNLOCK (self);
+}
+
+/* adds the counts of the analysis thread, and of the FFT threads that work
+ * for it, to the published ones now and then, or right away with @force */
+static void
+gst_spectrogram_publish_stats (GstSpectrogram * self, gboolean force)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  GstClockTime elapsed = now - self->analysis_published;
+  GstSpectrogramStats *local = &self->analysis_stats;
+  GstStructure *s = NULL;
+  GstClockTime interval;
+  guint c;
+
+  GST_OBJECT_LOCK (self);
+  interval = self->stats_interval;
+  GST_OBJECT_UNLOCK (self);
+
+  if (!force && elapsed < STATS_PUBLISH_PERIOD &&
+      (!interval || elapsed < interval))
+    return;
+
+  /* the FFT threads are idle between hops */
+  if (self->channel_data) {
+    for (c = 0; c < self->num_channels; c++) {
+      GstSpectrogramStats *cs = &self->channel_data[c].stats;
+
+      gst_spectrogram_stats_add (local, cs);
+      memset (cs, 0, sizeof (GstSpectrogramStats));
+    }
+  }
+
+  GST_OBJECT_LOCK (self);
+  gst_spectrogram_stats_add (&self->stats, local);
+  if (elapsed > 0)
+    self->ffts_per_second = (gdouble) local->ffts * GST_SECOND / elapsed;
+  if (self->stats_interval &&
+      (force || now - self->stats_posted >= self->stats_interval)) {
+    self->stats_posted = now;
+    s = gst_spectrogram_stats_structure (self);
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  memset (local, 0, sizeof (GstSpectrogramStats));
+  self->analysis_published = now;
+
+  if (s)
+    gst_element_post_message (GST_ELEMENT (self),
+        gst_message_new_element (GST_OBJECT (self), s));
+}
+
+/* the same for the chain function while the worker runs the analysis */
+static void
+gst_spectrogram_publish_chain_stats (GstSpectrogram * self, gboolean force)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+
+  if (!force && now - self->chain_published < STATS_PUBLISH_PERIOD)
+    return;
+
+  GST_OBJECT_LOCK (self);
+  gst_spectrogram_stats_add (&self->stats, &self->chain_stats);
+  GST_OBJECT_UNLOCK (self);
+
+  memset (&self->chain_stats, 0, sizeof (GstSpectrogramStats));
+  self->chain_published = now;
+}
+
+/* publishes what the periodic updates have not yet, once no thread adds
+ * to the counts anymore */
+static void
+gst_spectrogram_flush_stats (GstSpectrogram * self)
+{
+  gst_spectrogram_publish_chain_stats (self, TRUE);
+  gst_spectrogram_publish_stats (self, TRUE);
+}
+
 static void
 gst_spectrogram_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -352,31 +1276,66 @@ gst_spectrogram_set_property (GObject * object, guint prop_id,
   GstSpectrogram *filter = GST_SPECTROGRAM (object);
 
   switch (prop_id) {
-    case PROP_BANDS:{
-      guint bands = g_value_get_uint (value);
-      if (filter->bands != bands) {
-        filter->bands = bands;
-        gst_spectrogram_reset_state (filter);
-      }
-    }
+    case PROP_BANDS:
+      /* picked up by the streaming thread at the next column */
+      filter->bands = g_value_get_uint (value);
       break;
     case PROP_THRESHOLD:
       filter->threshold = g_value_get_int (value);
       break;
     case PROP_MULTI_CHANNEL:{
+      /* like the layout, picked up by the streaming thread */
       gboolean multi_channel = g_value_get_boolean (value);
-      if (filter->multi_channel != multi_channel) {
-        filter->multi_channel = multi_channel;
-        gst_spectrogram_reset_state (filter);
-      }
+      if ((filter->layout != GST_SPECTROGRAM_LAYOUT_MIXED) != multi_channel)
+        filter->layout = multi_channel ?
+            GST_SPECTROGRAM_LAYOUT_STACKED : GST_SPECTROGRAM_LAYOUT_MIXED;
     }
       break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    case PROP_LAYOUT:
+      /* picked up by the streaming thread at the next buffer */
+      filter->layout = g_value_get_enum (value);
       break;
-  }
-}
-
+    case PROP_HOP_SIZE:
+      filter->hop_size = g_value_get_uint (value);
+      break;
+    case PROP_OVERLAP:
+      filter->overlap = g_value_get_double (value);
+      break;
+    case PROP_WINDOW:
+      filter->window = g_value_get_enum (value);
+      break;
+    case PROP_WORKER:
+      filter->worker = g_value_get_boolean (value);
+      break;
+    case PROP_COLORMAP:
+      filter->colormap = g_value_get_enum (value);
+      break;
+    case PROP_ATTACH_META:
+      filter->attach_meta = g_value_get_boolean (value);
+      break;
+    case PROP_POST_MESSAGES:
+      filter->post_messages = g_value_get_boolean (value);
+      break;
+    case PROP_MODE:
+      filter->mode = g_value_get_enum (value);
+      break;
+    case PROP_OFFLINE_TILES:
+      filter->offline_tiles = g_value_get_boolean (value);
+      break;
+    case PROP_FFTS_PER_FRAME:
+      filter->ffts_per_frame = g_value_get_uint (value);
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (filter);
+      filter->stats_interval = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
 static void
 gst_spectrogram_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec)
@@ -391,7 +1350,56 @@ gst_spectrogram_get_property (GObject * object, guint prop_id,
       g_value_set_int (value, filter->threshold);
       break;
     case PROP_MULTI_CHANNEL:
-      g_value_set_boolean (value, filter->multi_channel);
+      g_value_set_boolean (value,
+          filter->layout != GST_SPECTROGRAM_LAYOUT_MIXED);
+      break;
+    case PROP_LAYOUT:
+      g_value_set_enum (value, filter->layout);
+      break;
+    case PROP_HOP_SIZE:
+      g_value_set_uint (value, filter->hop_size);
+      break;
+    case PROP_OVERLAP:
+      g_value_set_double (value, filter->overlap);
+      break;
+    case PROP_WINDOW:
+      g_value_set_enum (value, filter->window);
+      break;
+    case PROP_WORKER:
+      g_value_set_boolean (value, filter->worker);
+      break;
+    case PROP_COLORMAP:
+      g_value_set_enum (value, filter->colormap);
+      break;
+    case PROP_ATTACH_META:
+      g_value_set_boolean (value, filter->attach_meta);
+      break;
+    case PROP_POST_MESSAGES:
+      g_value_set_boolean (value, filter->post_messages);
+      break;
+    case PROP_MODE:
+      g_value_set_enum (value, filter->mode);
+      break;
+    case PROP_OFFLINE_TILES:
+      g_value_set_boolean (value, filter->offline_tiles);
+      break;
+    case PROP_FFTS_PER_FRAME:
+      g_value_set_uint (value, filter->ffts_per_frame);
+      break;
+    case PROP_STATS:
+      GST_OBJECT_LOCK (filter);
+      g_value_take_boxed (value, gst_spectrogram_stats_structure (filter));
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint64 (value, filter->stats_interval);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_FRAMES_DROPPED:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_uint64 (value, filter->frames_dropped);
+      GST_OBJECT_UNLOCK (filter);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -414,7 +1422,8 @@ input_data_mixed_int16_max (const guint8 * _in, gfloat * out, guint len,
     for (i = 1; i < channels; i++)
       v += in[ip++] / max_value;
     out[op] = v / channels;
-    op = (op + 1) % nfft;
+    if (++op == nfft)
+      op = 0;
   }
 }
 
@@ -429,52 +1438,113 @@ input_data_int16_max (const guint8 * _in, gfloat * out, guint len,
 
   for (j = 0, ip = 0; j < len; j++, ip += channels) {
     out[op] = in[ip] / max_value;
-    op = (op + 1) % nfft;
+    if (++op == nfft)
+      op = 0;
   }
 }
 
 static gboolean
 gst_spectrogram_setup (GstSpectrogram * self)
 {
-  self->input_data =
-    self->multi_channel ? input_data_int16_max : input_data_mixed_int16_max;
-
   gst_spectrogram_reset_state (self);
   return TRUE;
 }
 
+/* number of frames between the starts of two consecutive FFT windows */
+static guint
+gst_spectrogram_calculate_hop (GstSpectrogram * self, guint window_len)
+{
+  guint hop = self->hop_size;
+
+  if (hop == 0)
+    hop = (guint) (window_len * (1.0 - self->overlap) + 0.5);
+
+  return MAX (hop, 1);
+}
+
 static void
 gst_spectrogram_run_fft (GstSpectrogram * self, GstSpectrumChannel * cd,
     guint input_pos)
 {
   guint i;
-  guint bands = self->bands;
-  guint nfft = 2 * bands - 2;
+  guint bands = self->num_bands;
+  guint len = self->window_len;
+  guint tail = len - input_pos;
   gint threshold = self->threshold;
   gfloat *input = cd->input;
   gfloat *input_tmp = cd->input_tmp;
   gfloat *spect_magnitude = cd->spect_magnitude;
+  const gfloat *window = self->window_table;
+  const guint *band_bins = self->band_bins;
   GstFFTF32Complex *freqdata = cd->freqdata;
   GstFFTF32 *fft_ctx = cd->fft_ctx;
+  GstClockTime start = gst_util_get_timestamp ();
+  GstClockTime elapsed;
 
-  for (i = 0; i < nfft; i++)
-    input_tmp[i] = input[(input_pos + i) % nfft];
-
-  gst_fft_f32_window (fft_ctx, input_tmp, GST_FFT_WINDOW_HAMMING);
+  /* unroll the ring buffer, oldest frame first, and apply the window on the
+   * way; input_pos is where the next frame will be written, i.e. the oldest
+   * one in the window.  input_tmp[len..nfft) stays zero for padding */
+  for (i = 0; i < tail; i++)
+    input_tmp[i] = input[input_pos + i] * window[i];
+  for (; i < len; i++)
+    input_tmp[i] = input[i - tail] * window[i];
 
   gst_fft_f32_fft (fft_ctx, input_tmp, freqdata);
 
-  gdouble val;
-  /* Calculate magnitude in db */
-  for (i = 0; i < bands; i++) {
-    val = freqdata[i].r * freqdata[i].r;
-    val += freqdata[i].i * freqdata[i].i;
-    val /= nfft * nfft;
-    val = 10.0 * log10 (val);
-    if (val < threshold)
-      val = threshold;
-    spect_magnitude[i] += val;
+  /* band_bins[i] >= i, so the bands can be gathered in place */
+  if (band_bins) {
+    for (i = 0; i < bands; i++)
+      freqdata[i] = freqdata[band_bins[i]];
   }
+
+  /* Calculate magnitude in db, normalized to the unpadded window */
+  spectral_power_to_db_add ((const gfloat *) freqdata, spect_magnitude, bands,
+      1.0f / ((gfloat) len * len), threshold);
+
+  /* only ever touched by the thread running this channel */
+  elapsed = gst_util_get_timestamp () - start;
+  cd->stats.ffts++;
+  cd->stats.fft_time += elapsed;
+  cd->stats.fft_max = MAX (cd->stats.fft_max, elapsed);
+}
+
+static void
+gst_spectrogram_fft_task (gpointer data, gpointer user_data)
+{
+  GstSpectrogram *self = GST_SPECTROGRAM (user_data);
+
+  gst_spectrogram_run_fft (self, (GstSpectrumChannel *) data,
+      self->fft_input_pos);
+
+  g_mutex_lock (&self->fft_lock);
+  if (--self->fft_pending == 0)
+    g_cond_signal (&self->fft_cond);
+  g_mutex_unlock (&self->fft_lock);
+}
+
+static void
+gst_spectrogram_run_ffts (GstSpectrogram * self, guint input_pos,
+    guint output_channels)
+{
+  guint c;
+
+  if (!self->fft_pool) {
+    for (c = 0; c < output_channels; c++)
+      gst_spectrogram_run_fft (self, &self->channel_data[c], input_pos);
+    return;
+  }
+
+  self->fft_input_pos = input_pos;
+  self->fft_pending = output_channels - 1;
+  for (c = 1; c < output_channels; c++)
+    g_thread_pool_push (self->fft_pool, &self->channel_data[c], NULL);
+
+  gst_spectrogram_run_fft (self, &self->channel_data[0], input_pos);
+
+  g_mutex_lock (&self->fft_lock);
+  while (self->fft_pending > 0)
+    g_cond_wait (&self->fft_cond, &self->fft_lock);
+  g_mutex_unlock (&self->fft_lock);
 }
 
 static void
@@ -483,7 +1553,7 @@ gst_spectrogram_reset_message_data (GstSpectrogram * self,
 {
   g_return_if_fail (cd != NULL);
 
-  guint bands = self->bands;
+  guint bands = self->num_bands;
   gfloat *spect_magnitude = cd->spect_magnitude;
   gfloat *spect_phase = cd->spect_phase;
 
@@ -495,170 +1565,604 @@ gst_spectrogram_reset_message_data (GstSpectrogram * self,
 static double
 scale_value (double val, double threshold)
 {
-  // the inflection point between the two halves of the alpha formula
-  const float TX = 0.6;
-  const float TY = 0.85;
-  // multiplier for the first segment
-  const float k = (1 / TX) * (1 / TX) * TY;
-  // slope and offset of the second segment
-  const float m = (1.0 - TY) / (1.0 - TX);
-  const float b = TY - m * TX;
-
-  val = CLAMP (val, threshold, 0.0);
-
-  double shade = (val - threshold) / abs(threshold);
-  if (shade > 0.0)
-  {
-    // Try to decrease the background noise a bit while making the
-    // foreground noise stand out a bit better.  From 0 to T, we
-    // use a parabolic (squared) slope to de-emphasize the lower
-    // levels, and from T and up, we simply map the aplitude
-    // directly to the alpha.
-    if (shade < TX)
-    {
-      shade = k * shade * shade;
-    }
-    else
-    {
-      shade = m * shade + b;
+  return spectral_shade (MIN (val, 0.0), threshold);
+}
+
+/* maps a shade from 0 (at or below the threshold) to 255 (0 dB) to a pixel of
+ * the negotiated format */
+static void
+gst_spectrogram_update_lut (GstSpectrogram * self)
+{
+  const guint8 (*stops)[3] = NULL;
+  gint i;
+
+  if (GST_VIDEO_INFO_FORMAT (&self->vinfo) == GST_VIDEO_FORMAT_RGBx) {
+    if (self->colormap == GST_SPECTROGRAM_COLORMAP_INFERNO)
+      stops = inferno_stops;
+    else if (self->colormap == GST_SPECTROGRAM_COLORMAP_VIRIDIS)
+      stops = viridis_stops;
+  }
+
+  for (i = 0; i < 256; i++) {
+    guint8 *lut = self->lut[i];
+
+    if (stops) {
+      gint s = i * (COLORMAP_STOPS - 1) / 255;
+      gint frac = i * (COLORMAP_STOPS - 1) - s * 255;
+      gint n = MIN (s + 1, COLORMAP_STOPS - 1);
+      gint c;
+
+      for (c = 0; c < 3; c++)
+        lut[c] = (stops[s][c] * (255 - frac) + stops[n][c] * frac) / 255;
+    } else {
+      /* dark on white, as in the thumbnails */
+      lut[0] = lut[1] = lut[2] = 0xff - i;
     }
+    lut[3] = 0;
   }
 
-  return shade;
+  self->lut_colormap = self->colormap;
 }
 
+/* number of columns that fit in the picture for each channel */
+static guint
+gst_spectrogram_history_length (GstSpectrogram * self)
+{
+  if (self->active_layout == GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE)
+    return MAX (self->width / self->num_channels, 1);
+
+  return self->width;
+}
+
+/* shades rows pixels of one channel, highest band first */
 static void
-gst_spectrogram_push_spectrum_data (GstSpectrogram *self)
+gst_spectrogram_shade_column (GstSpectrogram * self, GstSpectrumChannel * cd,
+    guchar * dest, gint rows)
 {
-  guchar *slice = g_new0 (guchar, self->height * 4);
+  guint bpp = self->bpp;
+  /* magnitudes are summed over all FFTs of the interval */
+  gdouble norm = 1.0 / MAX (self->num_fft, 1);
   int i;
-  for (i = 0; i < self->height; i++) {
-    guchar *d = slice + (i * 4);
-    gint band = ((double)(self->height - (i + 1)) / self->height) * self->bands;
-    //gint band = self->bands - (1 + i);
-    gdouble level = (self->channel_data[0].spect_magnitude[band]);
-    guchar scaled = 0xff - (0xff * scale_value (level, self->threshold));
-    d[0] = scaled;
-    d[1] = scaled;
-    d[2] = scaled;
-  }
-
-  while (g_queue_get_length (self->spectrogram_data) >= self->width) {
-    guchar *old = g_queue_pop_tail (self->spectrogram_data);
-    g_free (old);
+
+  for (i = 0; i < rows; i++) {
+    guchar *d = dest + (i * bpp);
+    gint band = ((double)(rows - (i + 1)) / rows) * self->num_bands;
+    gdouble level = cd->spect_magnitude[band] * norm;
+    guchar scaled = 0xff * scale_value (level, self->threshold);
+    memcpy (d, self->lut[scaled], bpp);
   }
+}
+
+/* the next column slot of the offline store.  Columns are kept in tiles of
+ * TILE_COLUMNS so that a long stream never needs one huge allocation */
+static guchar *
+gst_spectrogram_offline_column (GstSpectrogram * self, gsize slice_size)
+{
+  guint index = self->tile_columns % TILE_COLUMNS;
+  guchar *tile;
+
+  if (index == 0)
+    g_ptr_array_add (self->tiles, g_malloc (TILE_COLUMNS * slice_size));
+  tile = g_ptr_array_index (self->tiles, self->tiles->len - 1);
+
+  g_array_append_val (self->tile_timestamps, self->column_ts);
+  self->tile_columns++;
+
+  return tile + index * slice_size;
+}
+
+static void
+gst_spectrogram_push_spectrum_data (GstSpectrogram *self)
+{
+  guint bpp = self->bpp;
+  guint n = self->num_channels;
+  guint history = gst_spectrogram_history_length (self);
+  gsize slice_size = self->height * bpp * gst_spectrogram_panels (self);
+  GstSpectrogramColumn *column = NULL;
+  guchar *slice;
+  guint c;
+
+  if (self->lut_colormap != self->colormap)
+    gst_spectrogram_update_lut (self);
+
+  if (self->mode == GST_SPECTROGRAM_MODE_OFFLINE) {
+    slice = gst_spectrogram_offline_column (self, slice_size);
+  } else {
+    /* recycle the column that scrolls out of the picture */
+    if (g_queue_get_length (self->spectrogram_data) >= history) {
+      column = g_queue_pop_tail (self->spectrogram_data);
+    } else {
+      column = g_malloc (sizeof (GstSpectrogramColumn) + slice_size);
+      column->pixels = (guint8 *) (column + 1);
+    }
+
+    while (g_queue_get_length (self->spectrogram_data) >= history) {
+      GstSpectrogramColumn *old = g_queue_pop_tail (self->spectrogram_data);
+      g_free (old);
+    }
+
+    column->timestamp = self->column_ts;
+    slice = column->pixels;
+  }
+
+  /* shade the column once, frames only copy the pixels.  Side by side, a
+   * slice holds one full height column per channel, otherwise the channels
+   * share the height */
+  switch (self->active_layout) {
+    case GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE:
+      for (c = 0; c < n; c++)
+        gst_spectrogram_shade_column (self, &self->channel_data[c],
+            slice + c * self->height * bpp, self->height);
+      break;
+    case GST_SPECTROGRAM_LAYOUT_STACKED:
+      for (c = 0; c < n; c++) {
+        gint top = c * self->height / n;
+        gint bottom = (c + 1) * self->height / n;
+
+        gst_spectrogram_shade_column (self, &self->channel_data[c],
+            slice + top * bpp, bottom - top);
+      }
+      break;
+    case GST_SPECTROGRAM_LAYOUT_MIXED:
+    default:
+      gst_spectrogram_shade_column (self, &self->channel_data[0], slice,
+          self->height);
+      break;
+  }
+
+  if (column)
+    g_queue_push_head (self->spectrogram_data, column);
+}
+
+/* keeps the levels of the column for the meta and messages of the next
+ * frame */
+static void
+gst_spectrogram_store_levels (GstSpectrogram * self)
+{
+  gfloat norm = 1.0f / MAX (self->num_fft, 1);
+  guint offset = self->pending_levels->len;
+  gfloat *levels;
+  guint c, i;
+
+  g_array_append_val (self->pending_timestamps, self->column_ts);
+  g_array_set_size (self->pending_levels,
+      offset + self->num_channels * self->num_bands);
+
+  levels = &g_array_index (self->pending_levels, gfloat, offset);
+  for (c = 0; c < self->num_channels; c++) {
+    const gfloat *magnitude = self->channel_data[c].spect_magnitude;
+
+    for (i = 0; i < self->num_bands; i++)
+      *levels++ = magnitude[i] * norm;
+  }
+}
+
+static void
+gst_spectrogram_post_levels (GstSpectrogram * self)
+{
+  GArray *timestamps = self->pending_timestamps;
+  GArray *levels = self->pending_levels;
+  GBytes *ts_bytes, *level_bytes;
+  GstStructure *s;
+
+  ts_bytes = g_bytes_new (timestamps->data,
+      timestamps->len * sizeof (GstClockTime));
+  level_bytes = g_bytes_new (levels->data, levels->len * sizeof (gfloat));
+
+  s = gst_structure_new ("spectrogram",
+      "bands", G_TYPE_UINT, self->num_bands,
+      "channels", G_TYPE_UINT, self->num_channels,
+      "columns", G_TYPE_UINT, timestamps->len,
+      "timestamps", G_TYPE_BYTES, ts_bytes,
+      "magnitudes", G_TYPE_BYTES, level_bytes, NULL);
+
+  g_bytes_unref (ts_bytes);
+  g_bytes_unref (level_bytes);
+
+  gst_element_post_message (GST_ELEMENT (self),
+      gst_message_new_element (GST_OBJECT (self), s));
+}
+
+static void
+gst_spectrogram_draw_column (GstSpectrogram * self, guint8 * data,
+    const guint8 * src, gint x)
+{
+  guint bpp = self->bpp;
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (&self->vinfo, 0);
+  guint8 *dest = data + x * bpp;
+  gint i;
+
+  if (bpp == 1) {
+    for (i = 0; i < self->height; i++, dest += stride)
+      *dest = src[i];
+  } else {
+    for (i = 0; i < self->height; i++, src += bpp, dest += stride)
+      memcpy (dest, src, bpp);
+  }
+}
 
-  g_queue_push_head (self->spectrogram_data, slice);
+/* draws the history into a frame of the negotiated format, newest column on
+ * the right (of each channel's panel when side by side) */
+static void
+gst_spectrogram_compose_frame (GstSpectrogram * self, guint8 * data)
+{
+  guint bpp = self->bpp;
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (&self->vinfo, 0);
+  const guint8 *background = self->lut[0];
+  guint history = gst_spectrogram_history_length (self);
+  gsize column_size = self->height * bpp;
+  GList *l;
+  gint i, x;
+  guint c;
+
+  /* columns that have not been analyzed yet */
+  for (x = 0; x < self->width; x++)
+    memcpy (data + x * bpp, background, bpp);
+  for (i = 1; i < self->height; i++)
+    memcpy (data + i * stride, data, self->width * bpp);
+
+  for (l = self->spectrogram_data->head, x = history - 1; l && x >= 0;
+      l = l->next, x--) {
+    const GstSpectrogramColumn *column = l->data;
+
+    if (self->active_layout == GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE) {
+      for (c = 0; c < self->num_channels; c++)
+        gst_spectrogram_draw_column (self, data,
+            column->pixels + c * column_size, c * history + x);
+    } else {
+      gst_spectrogram_draw_column (self, data, column->pixels, x);
+    }
+  }
 }
 
+/* draws columns [x0, x0 + width) of the offline image, where each panel is
+ * tile_columns wide, into a frame of the negotiated format */
+static void
+gst_spectrogram_compose_offline (GstSpectrogram * self, guint8 * data,
+    guint x0)
+{
+  guint bpp = self->bpp;
+  gint stride = GST_VIDEO_INFO_PLANE_STRIDE (&self->vinfo, 0);
+  gsize column_size = self->height * bpp;
+  gsize slice_size = column_size * gst_spectrogram_panels (self);
+  guint total = self->tile_columns * gst_spectrogram_panels (self);
+  gint i, x;
+
+  for (x = 0; x < self->width; x++) {
+    guint column = (x0 + x) % self->tile_columns;
+    guint panel = (x0 + x) / self->tile_columns;
+    const guint8 *tile;
+
+    if (x0 + x >= total) {
+      /* the last tile is only partly used */
+      for (i = 0; i < self->height; i++)
+        memcpy (data + i * stride + x * bpp, self->lut[0], bpp);
+      continue;
+    }
+
+    tile = g_ptr_array_index (self->tiles, column / TILE_COLUMNS);
+    gst_spectrogram_draw_column (self, data,
+        tile + (column % TILE_COLUMNS) * slice_size + panel * column_size, x);
+  }
+}
+
+/* asks downstream for a picture that is width columns wide */
+static gboolean
+gst_spectrogram_renegotiate_width (GstSpectrogram * self, gint width)
+{
+  GstCaps *caps = gst_pad_get_current_caps (self->srcpad);
+  gboolean res = FALSE;
+
+  if (!caps)
+    return FALSE;
+
+  caps = gst_caps_make_writable (caps);
+  gst_caps_set_simple (caps, "width", G_TYPE_INT, width, NULL);
+
+  if (gst_pad_peer_query_accept_caps (self->srcpad, caps) &&
+      gst_pad_set_caps (self->srcpad, caps))
+    res = gst_spectrogram_src_setcaps (self, caps);
+
+  gst_caps_unref (caps);
+  return res;
+}
+
+/* pushes everything that was analyzed in offline mode, at EOS */
 static GstFlowReturn
-gst_spectrogram_push_video_frame (GstSpectrogram *self)
+gst_spectrogram_push_offline (GstSpectrogram * self)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint total = self->tile_columns * gst_spectrogram_panels (self);
+  guint x;
+
+  if (self->tile_columns == 0 || !gst_pad_has_current_caps (self->srcpad))
+    return GST_FLOW_OK;
+
+  if (!self->offline_tiles && total != self->width &&
+      !gst_spectrogram_renegotiate_width (self, total))
+    GST_INFO_OBJECT (self, "downstream refused a width of %u, pushing tiles",
+        total);
+
+  GST_DEBUG_OBJECT (self, "pushing %u columns in tiles of %d", total,
+      self->width);
+
+  for (x = 0; x < total && ret == GST_FLOW_OK; x += self->width) {
+    GstBuffer *buffer;
+    GstMapInfo map;
+    guint columns = MIN (self->width, total - x);
+
+    buffer = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&self->vinfo),
+        NULL);
+    if (!buffer || !gst_buffer_map (buffer, &map, GST_MAP_WRITE)) {
+      if (buffer)
+        gst_buffer_unref (buffer);
+      return GST_FLOW_ERROR;
+    }
+
+    gst_spectrogram_compose_offline (self, map.data, x);
+    gst_buffer_unmap (buffer, &map);
+
+    GST_BUFFER_PTS (buffer) = g_array_index (self->tile_timestamps,
+        GstClockTime, x % self->tile_columns);
+    GST_BUFFER_DURATION (buffer) = columns * self->interval;
+
+    ret = gst_pad_push (self->srcpad, buffer);
+  }
+
+  return ret;
+}
+
+/* stream time of the next sample to be read */
+static GstClockTime
+gst_spectrogram_sample_time (GstSpectrogram * self)
+{
+  if (!GST_CLOCK_TIME_IS_VALID (self->base_ts) || self->rate <= 0)
+    return GST_CLOCK_TIME_NONE;
+
+  return self->base_ts + gst_util_uint64_scale_int (self->sample_offset,
+      GST_SECOND, self->rate);
+}
+
+/* whether downstream told us a frame at message_ts would be too late */
+static gboolean
+gst_spectrogram_frame_is_late (GstSpectrogram * self)
+{
+  GstClockTime running_time;
+  gboolean late = FALSE;
+
+  if (self->segment.format != GST_FORMAT_TIME ||
+      !GST_CLOCK_TIME_IS_VALID (self->message_ts))
+    return FALSE;
+
+  running_time = gst_segment_to_running_time (&self->segment, GST_FORMAT_TIME,
+      self->message_ts);
+
+  GST_OBJECT_LOCK (self);
+  if (GST_CLOCK_TIME_IS_VALID (running_time) &&
+      GST_CLOCK_TIME_IS_VALID (self->earliest_time) &&
+      running_time <= self->earliest_time) {
+    self->frames_dropped++;
+    late = TRUE;
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return late;
+}
+
+/* pushes the picture of the frame that starts at message_ts */
+static GstFlowReturn
+gst_spectrogram_push_video_frame (GstSpectrogram *self, GstClockTime duration)
 {
   GstBuffer *buffer = 0;
   GstFlowReturn ret;
-  int buffer_size = self->width * self->height * 4;
+  gsize buffer_size = GST_VIDEO_INFO_SIZE (&self->vinfo);
+  GstClockTime start, elapsed;
+
+  /* the columns are already in the history, just don't compose a frame
+   * that the sink would throw away */
+  if (gst_spectrogram_frame_is_late (self)) {
+    GST_DEBUG_OBJECT (self, "skipping late frame at %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (self->message_ts));
+    return GST_FLOW_OK;
+  }
+
+  start = gst_util_get_timestamp ();
   buffer = gst_buffer_new_allocate(NULL, buffer_size, NULL);
 
   if (!buffer)
-    return ret;
-
-  static guchar count = 0x1;
+    return GST_FLOW_ERROR;
 
   GstMapInfo map_info;
   if (!gst_buffer_map(buffer, &map_info, GST_MAP_WRITE)) {
-    return ret;
-  }
-
-  memset (map_info.data, 0xff, buffer_size);
-  int slices = g_queue_get_length (self->spectrogram_data);
-  int i;
-  for (i = 0; i < self->height; i++) {
-    int j;
-    for (j = 0; j < slices; j++) {
-      guchar *src = g_queue_peek_nth (self->spectrogram_data, j) + (i * 4);
-      guchar *dest = map_info.data + (self->width - (j + 1)) * 4 + (self->width *
-                                                                   4 * i);
-      dest[0] = src[0];
-      dest[1] = src[1];
-      dest[2] = src[2];
-    }
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
   }
-  count++;
 
-  GST_BUFFER_DTS(buffer) = self->message_ts;
+  gst_spectrogram_compose_frame (self, map_info.data);
   gst_buffer_unmap(buffer, &map_info);
 
+  GST_BUFFER_PTS (buffer) = self->message_ts;
+  GST_BUFFER_DURATION (buffer) = duration;
+
+  if (self->attach_meta && self->pending_timestamps->len > 0)
+    gst_buffer_add_spectrum_meta (buffer, self->num_bands, self->num_channels,
+        self->pending_timestamps->len,
+        (const GstClockTime *) self->pending_timestamps->data,
+        (const gfloat *) self->pending_levels->data);
+
   ret = gst_pad_push (self->srcpad, buffer);
 
-  return GST_FLOW_OK;
+  elapsed = gst_util_get_timestamp () - start;
+  self->analysis_stats.frames++;
+  self->analysis_stats.push_time += elapsed;
+  self->analysis_stats.push_max = MAX (self->analysis_stats.push_max, elapsed);
+  self->analysis_stats.bytes += buffer_size;
+
+  return ret;
+}
+
+/* after a flushing seek: when position is inside the retained history, drop
+ * the columns from position on and push the frame for position right away
+ * instead of waiting for a frame's worth of new audio */
+static void
+gst_spectrogram_redraw_at (GstSpectrogram * self, GstClockTime position)
+{
+  GstSpectrogramColumn *oldest, *newest;
+
+  if (self->mode == GST_SPECTROGRAM_MODE_OFFLINE ||
+      g_queue_is_empty (self->spectrogram_data) ||
+      !gst_pad_has_current_caps (self->srcpad))
+    return;
+
+  oldest = g_queue_peek_tail (self->spectrogram_data);
+  newest = g_queue_peek_head (self->spectrogram_data);
+
+  if (!GST_CLOCK_TIME_IS_VALID (position) ||
+      !GST_CLOCK_TIME_IS_VALID (oldest->timestamp) ||
+      position < oldest->timestamp ||
+      position > newest->timestamp + self->interval) {
+    GST_DEBUG_OBJECT (self, "seek outside of the history, starting over");
+    gst_spectrogram_free_history (self);
+    return;
+  }
+
+  while ((newest = g_queue_peek_head (self->spectrogram_data)) &&
+      newest->timestamp + self->interval > position) {
+    g_queue_pop_head (self->spectrogram_data);
+    g_free (newest);
+  }
+
+  GST_DEBUG_OBJECT (self, "redrawing at %" GST_TIME_FORMAT " from %u columns",
+      GST_TIME_ARGS (position), g_queue_get_length (self->spectrogram_data));
+
+  self->message_ts = position;
+  gst_spectrogram_push_video_frame (self, self->frame_duration);
+}
+
+/* derives the frames per column from the column interval */
+static void
+gst_spectrogram_configure_interval (GstSpectrogram * self)
+{
+  /* number of sample frames we process before posting a message
+   * interval is in ns */
+  self->frames_per_interval =
+      gst_util_uint64_scale (self->interval, self->rate, GST_SECOND);
+  self->frames_todo = self->frames_per_interval;
+  /* rounding error for frames_per_interval in ns,
+   * aggregated it in accumulated_error */
+  self->error_per_interval = (self->interval * self->rate) % GST_SECOND;
+  if (self->frames_per_interval == 0)
+    self->frames_per_interval = 1;
+
+  GST_INFO_OBJECT (self, "interval %" GST_TIME_FORMAT ", fpi %"
+      G_GUINT64_FORMAT ", error %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (self->interval), self->frames_per_interval,
+      GST_TIME_ARGS (self->error_per_interval));
 }
 
 static GstFlowReturn
-gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer)
+gst_spectrogram_process_data (GstSpectrogram * self, const guint8 * data,
+    guint size, GstClockTime timestamp, gboolean discont)
 {
   GstFlowReturn ret = GST_FLOW_OK;
   guint rate = self->rate;
   guint channels = self->format_channels;
-  guint output_channels = self->multi_channel ? channels : 1;
+  guint output_channels;
   guint c;
   guint width = 16 / 8;
   gfloat max_value = (1UL << (16 - 1)) - 1;
-  guint bands = self->bands;
-  guint nfft = 2 * bands - 2;
+  guint window_len, hop;
   guint input_pos;
   gfloat *input;
-  const guint8 *data = GST_BUFFER_DATA (buffer);
-  guint size = GST_BUFFER_SIZE (buffer);
   guint frame_size = width * channels;
   guint fft_todo, msg_todo, block_size;
-  gboolean have_full_interval;
+  gboolean have_full_interval, have_full_hop;
   GstSpectrumChannel *cd;
   GstSpectrumInputData input_data;
 
-  GST_LOG_OBJECT (self, "input size: %d bytes", GST_BUFFER_SIZE (buffer));
+  GST_LOG_OBJECT (self, "input size: %u bytes", size);
 
-  if (GST_BUFFER_IS_DISCONT (buffer)) {
+  if (discont) {
     GST_DEBUG_OBJECT (self, "Discontinuity detected -- flushing");
-    gst_spectrogram_flush (self);
+    /* the offline image is built from the whole stream, so a gap in it
+     * must not throw away what was rendered before */
+    if (self->mode == GST_SPECTROGRAM_MODE_OFFLINE)
+      gst_spectrogram_flush_analysis (self);
+    else
+      gst_spectrogram_flush (self);
+  }
+
+  /* a new layout changes which channels are analyzed and how the picture is
+   * laid out, so it starts over with the next buffer */
+  if (self->channel_data && self->active_layout != self->layout) {
+    GST_DEBUG_OBJECT (self, "layout changed from %d to %d",
+        self->active_layout, self->layout);
+    gst_spectrogram_reset_state (self);
   }
 
   /* If we don't have a FFT context yet (or it was reset due to parameter
    * changes) get one and allocate memory for everything
    */
   if (self->channel_data == NULL) {
-    GST_DEBUG_OBJECT (self, "allocating for bands %u", bands);
+    GST_DEBUG_OBJECT (self, "allocating for bands %u", self->bands);
 
     gst_spectrogram_alloc_channel_data (self);
 
-    /* number of sample frames we process before posting a message
-     * interval is in ns */
-    self->frames_per_interval =
-        gst_util_uint64_scale (self->interval, rate, GST_SECOND);
-    self->frames_todo = self->frames_per_interval;
-    /* rounding error for frames_per_interval in ns,
-     * aggregated it in accumulated_error */
-    self->error_per_interval = (self->interval * rate) % GST_SECOND;
-    if (self->frames_per_interval == 0)
-      self->frames_per_interval = 1;
-
-    GST_INFO_OBJECT (self, "interval %" GST_TIME_FORMAT ", fpi %"
-        G_GUINT64_FORMAT ", error %" GST_TIME_FORMAT,
-        GST_TIME_ARGS (self->interval), self->frames_per_interval,
-        GST_TIME_ARGS (self->error_per_interval));
+    gst_spectrogram_configure_interval (self);
 
     self->input_pos = 0;
 
     gst_spectrogram_flush (self);
   }
 
-  self->message_ts = GST_BUFFER_TIMESTAMP (buffer);
+  output_channels = self->num_channels;
+
+  window_len = self->window_len;
+  hop = gst_spectrogram_calculate_hop (self, window_len);
+
+  /* timestamps are only taken from the first buffer after a flush or
+   * discontinuity, from there on the samples are counted so that jitter in
+   * the upstream timestamps does not end up in the frames */
+  if (!GST_CLOCK_TIME_IS_VALID (self->base_ts) &&
+      GST_CLOCK_TIME_IS_VALID (timestamp)) {
+    self->base_ts = timestamp;
+    self->sample_offset = 0;
+  }
 
   input_pos = self->input_pos;
   input_data = self->input_data;
 
+  /* the hop may have been shortened since the last buffer */
+  if (self->hop_frames >= hop)
+    self->hop_frames = 0;
+
   while (size >= frame_size) {
+    /* a new column, and maybe a new frame, starts here.  Changed settings
+     * are applied here so that a column never mixes them.  New bands wait
+     * for a new frame as well, since the levels of the columns of a frame
+     * are collected into one array of num_bands per column */
+    if (self->num_frames == 0) {
+      if (self->num_bands != self->bands && self->video_count == 0) {
+        GST_DEBUG_OBJECT (self, "bands changed from %u to %u", self->num_bands,
+            self->bands);
+        self->input_pos = input_pos;
+        gst_spectrogram_configure_bands (self);
+        input_pos = self->input_pos;
+        window_len = self->window_len;
+        hop = gst_spectrogram_calculate_hop (self, window_len);
+        if (self->hop_frames >= hop)
+          self->hop_frames = 0;
+      } else if (self->window_type != self->window) {
+        gst_spectrogram_fill_window_table (self);
+      }
+
+      self->column_ts = gst_spectrogram_sample_time (self);
+      if (self->video_count == 0)
+        self->message_ts = self->column_ts;
+    }
+
     /* run input_data for a chunk of data */
-    fft_todo = nfft - (self->num_frames % nfft);
+    fft_todo = hop - self->hop_frames;
     msg_todo = self->frames_todo - self->num_frames;
     GST_LOG_OBJECT (self,
         "message frames todo: %u, fft frames todo: %u, input frames %u",
@@ -674,33 +2178,34 @@ gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer)
       input = cd->input;
       /* Move the current frames into our ringbuffers */
       input_data (data + c * width, input, block_size, channels, max_value,
-          input_pos, nfft);
+          input_pos, window_len);
     }
     data += block_size * frame_size;
     size -= block_size * frame_size;
-    input_pos = (input_pos + block_size) % nfft;
+    self->sample_offset += block_size;
+    input_pos = (input_pos + block_size) % window_len;
     self->num_frames += block_size;
+    self->hop_frames += block_size;
 
     have_full_interval = (self->num_frames == self->frames_todo);
+    have_full_hop = (self->hop_frames == hop);
 
     GST_LOG_OBJECT (self, "size: %u, do-fft = %d, do-message = %d", size,
-        (self->num_frames % nfft == 0), have_full_interval);
+        have_full_hop, have_full_interval);
 
-    /* If we have enough frames for an FFT or we have all frames required for
+    /* If we have advanced by a hop or we have all frames required for
      * the interval and we haven't run a FFT, then run an FFT */
-    if ((self->num_frames % nfft == 0) ||
-        (have_full_interval && !self->num_fft)) {
-      for (c = 0; c < output_channels; c++) {
-        cd = &self->channel_data[c];
-        gst_spectrogram_run_fft (self, cd, input_pos);
-      }
+    if (have_full_hop || (have_full_interval && !self->num_fft)) {
+      gst_spectrogram_run_ffts (self, input_pos, output_channels);
       self->num_fft++;
     }
+    if (have_full_hop)
+      self->hop_frames = 0;
 
     /* Do we have the FFTs for one interval? */
     if (have_full_interval) {
-      GST_DEBUG_OBJECT (self, "nfft: %u frames: %" G_GUINT64_FORMAT
-          " fpi: %" G_GUINT64_FORMAT " error: %" GST_TIME_FORMAT, nfft,
+      GST_DEBUG_OBJECT (self, "window_len: %u frames: %" G_GUINT64_FORMAT
+          " fpi: %" G_GUINT64_FORMAT " error: %" GST_TIME_FORMAT, window_len,
           self->num_frames, self->frames_per_interval,
           GST_TIME_ARGS (self->accumulated_error));
 
@@ -712,19 +2217,34 @@ gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer)
       self->accumulated_error += self->error_per_interval;
 
       gst_spectrogram_push_spectrum_data (self);
+      if (self->attach_meta || self->post_messages)
+        gst_spectrogram_store_levels (self);
+
+      if (++self->video_count == self->ffts_per_frame) {
+        GstClockTime end = gst_spectrogram_sample_time (self);
 
-      if (self->video_count++ == (FFT_PER_VFRAME - 1)) {
-        gst_spectrogram_push_video_frame (self);
+        if (self->mode != GST_SPECTROGRAM_MODE_OFFLINE)
+          ret = gst_spectrogram_push_video_frame (self,
+              GST_CLOCK_TIME_IS_VALID (self->message_ts) ?
+              end - self->message_ts : GST_CLOCK_TIME_NONE);
+
+        /* posted even when the frame itself was too late to draw */
+        if (self->post_messages && self->pending_timestamps->len > 0)
+          gst_spectrogram_post_levels (self);
+        g_array_set_size (self->pending_timestamps, 0);
+        g_array_set_size (self->pending_levels, 0);
 
         self->video_count = 0;
       }
 
-      for (c = 0; c < self->num_channels; c++) {
+      for (c = 0; c < output_channels; c++) {
         cd = &self->channel_data[c];
         gst_spectrogram_reset_message_data (self, cd);
       }
       self->num_frames = 0;
       self->num_fft = 0;
+
+      gst_spectrogram_publish_stats (self, FALSE);
     }
   }
 
@@ -735,6 +2255,245 @@ gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer)
   return ret;
 }
 
+static GstFlowReturn
+gst_spectrogram_process_buffer (GstSpectrogram * self, GstBuffer * buffer)
+{
+  GstMapInfo map;
+  GstFlowReturn ret;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return GST_FLOW_ERROR;
+
+  ret = gst_spectrogram_process_data (self, map.data, map.size,
+      GST_BUFFER_TIMESTAMP (buffer), GST_BUFFER_IS_DISCONT (buffer));
+
+  gst_buffer_unmap (buffer, &map);
+
+  return ret;
+}
+
+/* worker thread */
+
+/* called after moving an index; the producer, the worker and the drainer all
+ * sleep on the same cond, so everybody is woken up to recheck */
+static void
+gst_spectrogram_wake_queue (GstSpectrogram * self)
+{
+  if (g_atomic_int_get (&self->queue_waiters) > 0) {
+    g_mutex_lock (&self->queue_lock);
+    g_cond_broadcast (&self->queue_cond);
+    g_mutex_unlock (&self->queue_lock);
+  }
+}
+
+static void
+gst_spectrogram_worker_loop (GstSpectrogram * self)
+{
+  gint tail = g_atomic_int_get (&self->queue_tail);
+  GstSpectrogramChunk *chunk;
+  GstFlowReturn ret;
+
+  if (tail == g_atomic_int_get (&self->queue_head)) {
+    gboolean flushing;
+
+    g_mutex_lock (&self->queue_lock);
+    g_atomic_int_inc (&self->queue_waiters);
+    while (!g_atomic_int_get (&self->queue_flushing) &&
+        tail == g_atomic_int_get (&self->queue_head))
+      g_cond_wait (&self->queue_cond, &self->queue_lock);
+    g_atomic_int_add (&self->queue_waiters, -1);
+    flushing = g_atomic_int_get (&self->queue_flushing);
+    g_mutex_unlock (&self->queue_lock);
+
+    if (flushing) {
+      gst_pad_pause_task (self->srcpad);
+      return;
+    }
+  }
+
+  chunk = &self->queue[tail];
+
+  /* after an error keep draining, the chain function reports it */
+  if (g_atomic_int_get (&self->worker_ret) == GST_FLOW_OK) {
+    ret = gst_spectrogram_process_data (self, chunk->data, chunk->size,
+        chunk->timestamp, chunk->discont);
+    if (ret != GST_FLOW_OK)
+      g_atomic_int_set (&self->worker_ret, ret);
+  }
+
+  g_atomic_int_set (&self->queue_tail, (tail + 1) % WORKER_QUEUE_SIZE);
+  gst_spectrogram_wake_queue (self);
+}
+
+static GstFlowReturn
+gst_spectrogram_queue_buffer (GstSpectrogram * self, GstBuffer * buffer)
+{
+  gint head = g_atomic_int_get (&self->queue_head);
+  gint next = (head + 1) % WORKER_QUEUE_SIZE;
+  GstSpectrogramChunk *chunk;
+  GstFlowReturn ret;
+  gsize size;
+
+  /* the lock is only needed to sleep on a full ring */
+  if (next == g_atomic_int_get (&self->queue_tail)) {
+    g_mutex_lock (&self->queue_lock);
+    g_atomic_int_inc (&self->queue_waiters);
+    while (!g_atomic_int_get (&self->queue_flushing) &&
+        next == g_atomic_int_get (&self->queue_tail))
+      g_cond_wait (&self->queue_cond, &self->queue_lock);
+    g_atomic_int_add (&self->queue_waiters, -1);
+    g_mutex_unlock (&self->queue_lock);
+  }
+
+  if (g_atomic_int_get (&self->queue_flushing))
+    return GST_FLOW_FLUSHING;
+
+  ret = g_atomic_int_get (&self->worker_ret);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  /* the chunk at head belongs to us until head is advanced */
+  chunk = &self->queue[head];
+  size = gst_buffer_get_size (buffer);
+  if (chunk->alloc_size < size) {
+    chunk->data = g_realloc (chunk->data, size);
+    chunk->alloc_size = size;
+  }
+  chunk->size = gst_buffer_extract (buffer, 0, chunk->data, size);
+  self->chain_stats.bytes += chunk->size;
+  gst_spectrogram_publish_chain_stats (self, FALSE);
+  chunk->timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  chunk->discont = GST_BUFFER_IS_DISCONT (buffer);
+
+  g_atomic_int_set (&self->queue_head, next);
+  gst_spectrogram_wake_queue (self);
+
+  return GST_FLOW_OK;
+}
+
+static void
+gst_spectrogram_start_worker (GstSpectrogram * self)
+{
+  GST_DEBUG_OBJECT (self, "starting worker thread");
+
+  if (!self->queue)
+    self->queue = g_new0 (GstSpectrogramChunk, WORKER_QUEUE_SIZE);
+  self->queue_head = 0;
+  self->queue_tail = 0;
+  self->queue_flushing = FALSE;
+  self->worker_ret = GST_FLOW_OK;
+
+  /* the FFT thread pool is set up with the channel data */
+  gst_spectrogram_reset_state (self);
+
+  self->worker_running = gst_pad_start_task (self->srcpad,
+      (GstTaskFunction) gst_spectrogram_worker_loop, self, NULL);
+}
+
+/* waits until the worker analyzed everything that was queued, so that what
+ * is pushed next is serialized after its frames */
+static void
+gst_spectrogram_drain_worker (GstSpectrogram * self)
+{
+  if (!self->worker_running)
+    return;
+
+  g_mutex_lock (&self->queue_lock);
+  g_atomic_int_inc (&self->queue_waiters);
+  while (!g_atomic_int_get (&self->queue_flushing) &&
+      g_atomic_int_get (&self->queue_tail) !=
+      g_atomic_int_get (&self->queue_head))
+    g_cond_wait (&self->queue_cond, &self->queue_lock);
+  g_atomic_int_add (&self->queue_waiters, -1);
+  g_mutex_unlock (&self->queue_lock);
+}
+
+/* wakes up both threads, called before the pads are deactivated so that a
+ * push blocked downstream returns as well */
+static void
+gst_spectrogram_unblock_worker (GstSpectrogram * self)
+{
+  g_mutex_lock (&self->queue_lock);
+  g_atomic_int_set (&self->queue_flushing, TRUE);
+  g_cond_broadcast (&self->queue_cond);
+  g_mutex_unlock (&self->queue_lock);
+}
+
+/* after FLUSH_STOP: the task paused itself when it saw queue_flushing, drop
+ * what is left in the ring and let it run again */
+static void
+gst_spectrogram_restart_worker (GstSpectrogram * self)
+{
+  if (!self->worker_running)
+    return;
+
+  gst_pad_pause_task (self->srcpad);
+
+  g_mutex_lock (&self->queue_lock);
+  self->queue_head = 0;
+  self->queue_tail = 0;
+  g_atomic_int_set (&self->queue_flushing, FALSE);
+  g_mutex_unlock (&self->queue_lock);
+  self->worker_ret = GST_FLOW_OK;
+
+  gst_pad_start_task (self->srcpad,
+      (GstTaskFunction) gst_spectrogram_worker_loop, self, NULL);
+}
+
+static void
+gst_spectrogram_stop_worker (GstSpectrogram * self)
+{
+  gint i;
+
+  if (!self->worker_running)
+    return;
+
+  GST_DEBUG_OBJECT (self, "stopping worker thread");
+
+  gst_spectrogram_unblock_worker (self);
+  gst_pad_stop_task (self->srcpad);
+  self->worker_running = FALSE;
+
+  for (i = 0; i < WORKER_QUEUE_SIZE; i++)
+    g_free (self->queue[i].data);
+  g_free (self->queue);
+  self->queue = NULL;
+}
+
+static GstStateChangeReturn
+gst_spectrogram_change_state (GstElement * element, GstStateChange transition)
+{
+  GstSpectrogram *self = GST_SPECTROGRAM (element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
+      self->redraw_pending = FALSE;
+      GST_OBJECT_LOCK (self);
+      self->frames_dropped = 0;
+      GST_OBJECT_UNLOCK (self);
+      gst_spectrogram_reset_stats (self);
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      gst_spectrogram_unblock_worker (self);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (gst_spectrogram_parent_class)->change_state
+      (element, transition);
+
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY) {
+    gst_spectrogram_stop_worker (self);
+    gst_spectrogram_flush_stats (self);
+    gst_spectrogram_reset_state (self);
+  }
+
+  return ret;
+}
+
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
@@ -25,6 +25,7 @@
 #include <gst/gst.h>
 #include <gst/base/gstadapter.h>
 #include <gst/fft/gstfftf32.h>
+#include <gst/video/video.h>
 
 G_BEGIN_DECLS
 
@@ -33,13 +34,58 @@ G_BEGIN_DECLS
 #define GST_IS_SPECTROGRAM(obj)         (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_SPECTROGRAM))
 #define GST_SPECTROGRAM_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_SPECTROGRAM,GstSpectrogramClass))
 #define GST_IS_SPECTROGRAM_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_SPECTROGRAM))
+/* FFT contexts kept per channel for recently used band counts */
+#define GST_SPECTROGRAM_FFT_CACHE_SIZE 4
+
 typedef struct _GstSpectrogram GstSpectrogram;
+typedef struct _GstSpectrogramStats GstSpectrogramStats;
 typedef struct _GstSpectrogramClass GstSpectrogramClass;
 typedef struct _GstSpectrumChannel GstSpectrumChannel;
+typedef struct _GstSpectrogramChunk GstSpectrogramChunk;
+typedef struct _GstSpectrogramColumn GstSpectrogramColumn;
+
+typedef enum
+{
+  GST_SPECTROGRAM_WINDOW_HANN,
+  GST_SPECTROGRAM_WINDOW_HAMMING,
+  GST_SPECTROGRAM_WINDOW_BLACKMAN_HARRIS
+} GstSpectrogramWindow;
+
+typedef enum
+{
+  GST_SPECTROGRAM_COLORMAP_GRAYSCALE,
+  GST_SPECTROGRAM_COLORMAP_INFERNO,
+  GST_SPECTROGRAM_COLORMAP_VIRIDIS
+} GstSpectrogramColormap;
+
+typedef enum
+{
+  GST_SPECTROGRAM_LAYOUT_MIXED,
+  GST_SPECTROGRAM_LAYOUT_STACKED,
+  GST_SPECTROGRAM_LAYOUT_SIDE_BY_SIDE
+} GstSpectrogramLayout;
+
+typedef enum
+{
+  GST_SPECTROGRAM_MODE_SCROLL,
+  GST_SPECTROGRAM_MODE_OFFLINE
+} GstSpectrogramMode;
 
 typedef void (*GstSpectrumInputData)(const guint8 * in, gfloat * out,
     guint len, guint channels, gfloat max_value, guint op, guint nfft);
 
+/* throughput counters, times in nanoseconds */
+struct _GstSpectrogramStats
+{
+  guint64 ffts;
+  GstClockTime fft_time;
+  GstClockTime fft_max;
+  guint64 frames;               /* video frames pushed */
+  GstClockTime push_time;
+  GstClockTime push_max;
+  guint64 bytes;                /* copied into the worker queue and frames */
+};
+
 struct _GstSpectrumChannel
 {
   gfloat *input;
@@ -47,7 +93,29 @@ struct _GstSpectrumChannel
   GstFFTF32Complex *freqdata;
   gfloat *spect_magnitude;      /* accumulated mangitude and phase */
   gfloat *spect_phase;          /* will be scaled by num_fft before sending */
-  GstFFTF32 *fft_ctx;
+  GstFFTF32 *fft_ctx;           /* one of fft_cache */
+  GstFFTF32 *fft_cache[GST_SPECTROGRAM_FFT_CACHE_SIZE];
+  guint fft_cache_nfft[GST_SPECTROGRAM_FFT_CACHE_SIZE];
+  guint fft_cache_next;
+  GstSpectrogramStats stats;    /* FFTs of this channel */
+};
+
+/* a copy of one input buffer, queued for the worker thread */
+struct _GstSpectrogramChunk
+{
+  guint8 *data;
+  gsize size;
+  gsize alloc_size;
+  GstClockTime timestamp;
+  gboolean discont;
+};
+
+/* one shaded column of the scrolling picture, allocated together with its
+ * pixels */
+struct _GstSpectrogramColumn
+{
+  GstClockTime timestamp;       /* start of the analyzed audio */
+  guint8 *pixels;
 };
 
 struct _GstSpectrogram
@@ -63,10 +131,33 @@ struct _GstSpectrogram
   gint bps;
 
   /* output format */
+  GstVideoInfo vinfo;
+  guint bpp;                    /* bytes per pixel */
   gint width;
   gint height;
   gint fps_n;
   gint fps_d;
+  GstClockTime frame_duration;
+
+  GstSegment segment;
+  gboolean redraw_pending;      /* flushed, redraw when the segment arrives */
+
+  /* QoS, protected by the object lock */
+  GstClockTime earliest_time;   /* running time of the next frame that would
+                                 * not arrive late downstream */
+  guint64 frames_dropped;
+
+  /* statistics: published totals, protected by the object lock */
+  GstSpectrogramStats stats;
+  gdouble ffts_per_second;      /* over the last publish period */
+  GstClockTime stats_interval;  /* between stats messages, 0 for none */
+  GstClockTime stats_posted;
+
+  /* counts of the analysis and chain threads not published yet */
+  GstSpectrogramStats analysis_stats;
+  GstClockTime analysis_published;
+  GstSpectrogramStats chain_stats;
+  GstClockTime chain_published;
 
   GQueue *spectrogram_data;
 
@@ -76,20 +167,78 @@ struct _GstSpectrogram
   guint64 frames_todo;
   guint bands;                  /* number of spectrum bands */
   gint threshold;               /* energy level treshold */
-  gboolean multi_channel;       /* send separate channel results */
+  GstSpectrogramLayout layout;  /* mixed down or one picture per channel */
+  gboolean attach_meta;         /* GstSpectrumMeta on the video frames */
+  gboolean post_messages;       /* levels as element messages */
+  GstSpectrogramMode mode;      /* scrolling frames or one image at EOS */
+  gboolean offline_tiles;       /* never renegotiate the width at EOS */
+  guint hop_size;               /* frames between FFTs, 0 derives it from
+                                 * overlap */
+  gdouble overlap;              /* fraction of the window shared by
+                                 * consecutive FFTs */
+  GstSpectrogramWindow window;  /* window function applied before the FFT */
+  gboolean worker;              /* analyze on a thread of our own */
+  GstSpectrogramColormap colormap;
 
-  gint video_count;
+  guint video_count;            /* columns added to the next frame */
 
   guint64 num_frames;           /* frame count (1 sample per channel)
                                  * since last emit */
   guint64 num_fft;              /* number of FFTs since last emit */
-  GstClockTime message_ts;      /* starttime for next message */
+  GstClockTime message_ts;      /* start time of the next frame */
+  guint ffts_per_frame;         /* columns per video frame */
 
   /* <private> */
   GstSpectrumChannel *channel_data;
   guint num_channels;
 
+  guint num_bands;              /* bands the channel data is sized for */
+  GstSpectrogramLayout active_layout; /* layout of the channel data */
+  guint window_len;             /* frames per analysis window */
+  guint nfft;                   /* window_len zero-padded to a fast size */
+  gfloat *window_table;         /* window_len coefficients of window_type */
+  GstSpectrogramWindow window_type;
+  guint *band_bins;             /* FFT bin of each band when padding, or NULL */
+
+  guint8 lut[256][4];           /* shade to pixel of the output format */
+  GstSpectrogramColormap lut_colormap;
+
+  /* levels of the columns since the last frame, for meta and messages */
+  GstClockTime base_ts;         /* timestamp of the first sample counted */
+  guint64 sample_offset;        /* frames read since base_ts */
+  GstClockTime column_ts;       /* start of the column being analyzed */
+  GArray *pending_timestamps;   /* GstClockTime per column */
+  GArray *pending_levels;       /* gfloat per band, channel and column */
+
+  /* offline mode: all columns of the stream, TILE_COLUMNS per tile */
+  GPtrArray *tiles;
+  GArray *tile_timestamps;      /* GstClockTime per column */
+  guint tile_columns;
+
+  /* worker thread: the chain function is the only producer and the src pad
+   * task the only consumer of the chunk ring, so the indices are only ever
+   * written from one side.  The lock and cond are just for sleeping on an
+   * empty or full ring, or until it is drained; queue_flushing is only
+   * changed under the lock so that no sleeper misses it */
+  gboolean worker_running;
+  GstSpectrogramChunk *queue;
+  gint queue_head;              /* next chunk to fill, written by chain */
+  gint queue_tail;              /* next chunk to analyze, written by task */
+  gint queue_waiters;           /* threads sleeping on queue_cond */
+  gint queue_flushing;          /* atomic gboolean */
+  GMutex queue_lock;
+  GCond queue_cond;
+  gint worker_ret;              /* GstFlowReturn of the last pushed frame */
+
+  /* per-channel FFTs of one hop spread over a few threads */
+  GThreadPool *fft_pool;
+  guint fft_input_pos;
+  gint fft_pending;
+  GMutex fft_lock;
+  GCond fft_cond;
+
   guint input_pos;
+  guint hop_frames;             /* frames read since the last FFT */
   guint64 error_per_interval;
   guint64 accumulated_error;
 
@@ -0,0 +1,127 @@
+/* GStreamer
+ * Copyright (C) <2011> Jonathon Jongsma <jonathon@quotidian.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gstspectrummeta.h"
+
+GType
+gst_spectrum_meta_api_get_type (void)
+{
+  static gsize type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstSpectrumMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+static gboolean
+gst_spectrum_meta_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
+{
+  GstSpectrumMeta *smeta = (GstSpectrumMeta *) meta;
+
+  smeta->bands = 0;
+  smeta->channels = 0;
+  smeta->n_columns = 0;
+  smeta->timestamps = NULL;
+  smeta->magnitudes = NULL;
+
+  return TRUE;
+}
+
+static void
+gst_spectrum_meta_free (GstMeta * meta, GstBuffer * buffer)
+{
+  GstSpectrumMeta *smeta = (GstSpectrumMeta *) meta;
+
+  g_free (smeta->timestamps);
+  g_free (smeta->magnitudes);
+}
+
+static gboolean
+gst_spectrum_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstSpectrumMeta *smeta = (GstSpectrumMeta *) meta;
+
+  /* the spectra describe the whole picture, so only plain copies keep them */
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  return gst_buffer_add_spectrum_meta (dest, smeta->bands, smeta->channels,
+      smeta->n_columns, smeta->timestamps, smeta->magnitudes) != NULL;
+}
+
+const GstMetaInfo *
+gst_spectrum_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter (&meta_info)) {
+    const GstMetaInfo *mi = gst_meta_register (GST_SPECTRUM_META_API_TYPE,
+        "GstSpectrumMeta", sizeof (GstSpectrumMeta),
+        gst_spectrum_meta_init, gst_spectrum_meta_free,
+        gst_spectrum_meta_transform);
+    g_once_init_leave (&meta_info, mi);
+  }
+  return meta_info;
+}
+
+/**
+ * gst_buffer_add_spectrum_meta:
+ * @buffer: a #GstBuffer
+ * @bands: number of bands per channel
+ * @channels: number of channels
+ * @n_columns: number of spectra
+ * @timestamps: @n_columns start times
+ * @magnitudes: @n_columns * @channels * @bands levels in dB
+ *
+ * Attaches a copy of the spectra to @buffer.
+ *
+ * Returns: the #GstSpectrumMeta on @buffer
+ */
+GstSpectrumMeta *
+gst_buffer_add_spectrum_meta (GstBuffer * buffer, guint bands,
+    guint channels, guint n_columns, const GstClockTime * timestamps,
+    const gfloat * magnitudes)
+{
+  GstSpectrumMeta *smeta;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  smeta = (GstSpectrumMeta *) gst_buffer_add_meta (buffer,
+      GST_SPECTRUM_META_INFO, NULL);
+  if (!smeta)
+    return NULL;
+
+  smeta->bands = bands;
+  smeta->channels = channels;
+  smeta->n_columns = n_columns;
+  smeta->timestamps = g_memdup2 (timestamps, n_columns * sizeof (GstClockTime));
+  smeta->magnitudes = g_memdup2 (magnitudes,
+      n_columns * channels * bands * sizeof (gfloat));
+
+  return smeta;
+}
@@ -0,0 +1,78 @@
+/* GStreamer
+ * Copyright (C) <2011> Jonathon Jongsma <jonathon@quotidian.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_SPECTRUM_META_H__
+#define __GST_SPECTRUM_META_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_SPECTRUM_META_API_TYPE (gst_spectrum_meta_api_get_type())
+#define GST_SPECTRUM_META_INFO (gst_spectrum_meta_get_info())
+
+typedef struct _GstSpectrumMeta GstSpectrumMeta;
+
+/**
+ * GstSpectrumMeta:
+ * @meta: parent #GstMeta
+ * @bands: number of frequency bands per channel
+ * @channels: number of analyzed channels
+ * @n_columns: number of spectra
+ * @timestamps: start time of each spectrum, @n_columns entries
+ * @magnitudes: levels in dB, @n_columns * @channels * @bands entries, all
+ *     bands of the first channel of the first spectrum first
+ *
+ * The spectra the spectrogram element analyzed since its previous video
+ * frame, so that downstream gets the numbers without running the FFTs a
+ * second time.
+ *
+ * The meta lives in the gstreamer-spectrummeta-1.0 library, which the
+ * plugin links as well, so applications that link it read the same API
+ * type off the frames:
+ * |[
+ * #include <gst/spectrogram/gstspectrummeta.h>
+ *
+ * GstSpectrumMeta *meta = gst_buffer_get_spectrum_meta (buffer);
+ * ]|
+ */
+struct _GstSpectrumMeta
+{
+  GstMeta meta;
+
+  guint bands;
+  guint channels;
+  guint n_columns;
+  GstClockTime *timestamps;
+  gfloat *magnitudes;
+};
+
+GType gst_spectrum_meta_api_get_type (void);
+const GstMetaInfo *gst_spectrum_meta_get_info (void);
+
+#define gst_buffer_get_spectrum_meta(b) \
+  ((GstSpectrumMeta *) gst_buffer_get_meta ((b), GST_SPECTRUM_META_API_TYPE))
+
+GstSpectrumMeta *gst_buffer_add_spectrum_meta (GstBuffer * buffer,
+    guint bands, guint channels, guint n_columns,
+    const GstClockTime * timestamps, const gfloat * magnitudes);
+
+G_END_DECLS
+
+#endif /* __GST_SPECTRUM_META_H__ */
@@ -0,0 +1,223 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#ifndef SOUNDPRINT_BUSMONITOR_H
+#define SOUNDPRINT_BUSMONITOR_H
+
+#include <gst/gst.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "phases.h"
+#include "trace.h"
+
+// Measures how long element messages wait on the bus: a sync handler notes
+// when the streaming thread posts each message, and the main loop calls
+// delivered() once it gets to handle it.  The messages in between are the
+// backlog; with a maximum set, a streaming thread posting into a full
+// backlog blocks until the main loop catches up.
+//
+// A sync callback can take element messages right on the posting thread;
+// the messages it returns true for never reach the main loop.
+class BusMonitor
+{
+public:
+    typedef bool (*SyncCallback) (GstMessage *message, gpointer user_data);
+
+    BusMonitor ()
+        : m_sync_callback (0)
+        , m_sync_data (0)
+        , m_trace (0)
+        , m_main_thread (0)
+        , m_max_backlog (0)
+        , m_peak_backlog (0)
+        , m_released (false)
+    {
+        g_mutex_init (&m_lock);
+        g_cond_init (&m_cond);
+    }
+
+    ~BusMonitor ()
+    {
+        g_cond_clear (&m_cond);
+        g_mutex_clear (&m_lock);
+    }
+
+    // attach from the thread running the main loop; max_backlog 0 means
+    // unlimited
+    void attach (GstBus *bus, TraceWriter *trace, guint max_backlog = 0)
+    {
+        m_trace = trace;
+        m_main_thread = g_thread_self ();
+        m_max_backlog = max_backlog;
+        m_released = false;
+        gst_bus_set_sync_handler (bus, on_sync_message, this, NULL);
+    }
+
+    // set before attaching
+    void set_sync_callback (SyncCallback callback, gpointer user_data)
+    {
+        m_sync_callback = callback;
+        m_sync_data = user_data;
+    }
+
+    // Wakes up blocked streaming threads and stops blocking new ones.  A
+    // flushing bus drops the backlog without delivering it, so this must
+    // be called before setting the pipeline to NULL.  A blocked thread
+    // also holds its stream lock, which a flushing seek waits for: release
+    // before such a seek and rearm() once it returns.
+    void release ()
+    {
+        g_mutex_lock (&m_lock);
+        m_released = true;
+        g_cond_broadcast (&m_cond);
+        g_mutex_unlock (&m_lock);
+    }
+
+    // blocks streaming threads on a full backlog again after release()
+    void rearm ()
+    {
+        g_mutex_lock (&m_lock);
+        m_released = false;
+        g_mutex_unlock (&m_lock);
+    }
+
+    // microseconds each delivered message spent on the bus
+    const std::vector<gint64> &latencies () const { return m_latencies; }
+    guint peak_backlog () const { return m_peak_backlog; }
+
+    // returns the microseconds message spent on the bus, or -1 when it was
+    // posted before the monitor was attached
+    gint64 delivered (GstMessage *message)
+    {
+        gint64 now = g_get_monotonic_time ();
+        gint64 posted = -1;
+
+        g_mutex_lock (&m_lock);
+        std::map<guint32, gint64>::iterator it =
+            m_posted.find (GST_MESSAGE_SEQNUM (message));
+        if (it != m_posted.end ())
+        {
+            posted = it->second;
+            m_posted.erase (it);
+            m_latencies.push_back (now - posted);
+            g_cond_signal (&m_cond);
+        }
+        guint backlog = m_posted.size ();
+        g_mutex_unlock (&m_lock);
+
+        if (posted < 0)
+            return -1;
+
+        if (m_trace)
+        {
+            m_trace->counter ("bus backlog", backlog);
+            const GstStructure *s = gst_message_get_structure (message);
+            m_trace->complete_on ("bus", "bus", s ? gst_structure_get_name (s)
+                                  : GST_MESSAGE_TYPE_NAME (message),
+                                  posted, now);
+        }
+        return now - posted;
+    }
+
+private:
+    static GstBusSyncReply on_sync_message (GstBus *, GstMessage *message,
+                                            gpointer user_data)
+    {
+        BusMonitor *self = static_cast<BusMonitor*>(user_data);
+
+        if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_ELEMENT)
+            return GST_BUS_PASS;
+
+        if (self->m_sync_callback &&
+            self->m_sync_callback (message, self->m_sync_data))
+            return GST_BUS_DROP;
+
+        g_mutex_lock (&self->m_lock);
+        // the main thread itself can never wait for the main loop
+        while (self->m_max_backlog && !self->m_released &&
+               self->m_posted.size () >= self->m_max_backlog &&
+               g_thread_self () != self->m_main_thread)
+            g_cond_wait (&self->m_cond, &self->m_lock);
+
+        self->m_posted[GST_MESSAGE_SEQNUM (message)] = g_get_monotonic_time ();
+        guint backlog = self->m_posted.size ();
+        self->m_peak_backlog = MAX (self->m_peak_backlog, backlog);
+        g_mutex_unlock (&self->m_lock);
+
+        if (self->m_trace)
+            self->m_trace->counter ("bus backlog", backlog);
+
+        return GST_BUS_PASS;
+    }
+
+    SyncCallback m_sync_callback;
+    gpointer m_sync_data;
+    GMutex m_lock;
+    GCond m_cond;
+    std::map<guint32, gint64> m_posted;
+    std::vector<gint64> m_latencies;
+    TraceWriter *m_trace;
+    GThread *m_main_thread;
+    guint m_max_backlog;
+    guint m_peak_backlog;
+    bool m_released;
+};
+
+// Collects the bus latencies of the runs of a benchmark
+class BusStats
+{
+public:
+    BusStats ()
+        : m_peak_backlog (0)
+    {}
+
+    void add (const BusMonitor &monitor)
+    {
+        m_latencies.insert (m_latencies.end (), monitor.latencies ().begin (),
+                            monitor.latencies ().end ());
+        m_peak_backlog = MAX (m_peak_backlog, monitor.peak_backlog ());
+    }
+
+    void print () const
+    {
+        if (m_latencies.empty ())
+            return;
+
+        std::vector<gint64> sorted (m_latencies);
+        std::sort (sorted.begin (), sorted.end ());
+        double sum = 0.0;
+        for (size_t i = 0; i < sorted.size (); ++i)
+            sum += sorted[i];
+
+        g_print ("bus latency (ms): mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, "
+                 "max %.3f\n", sum / sorted.size () / 1000.0,
+                 percentile (sorted, 50), percentile (sorted, 90),
+                 percentile (sorted, 99), sorted.back () / 1000.0);
+        g_print ("peak bus backlog: %u messages\n", m_peak_backlog);
+    }
+
+private:
+    std::vector<gint64> m_latencies;
+    guint m_peak_backlog;
+};
+
+#endif // SOUNDPRINT_BUSMONITOR_H
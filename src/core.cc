@@ -0,0 +1,197 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#include "core.h"
+#include <algorithm>
+#include <stdexcept>
+#include "spectral.h"
+
+namespace soundprint
+{
+
+OptionEntry::OptionEntry (const Glib::ustring &long_name,
+                          const Glib::ustring &description)
+{
+    set_long_name (long_name);
+    set_description (description);
+}
+
+OptionEntry::OptionEntry (gchar short_name,
+                          const Glib::ustring &long_name,
+                          const Glib::ustring &description)
+{
+    set_short_name (short_name);
+    set_long_name (long_name);
+    set_description (description);
+}
+
+std::string report_message (GstMessage *message)
+{
+    GError *error = NULL;
+    gchar *debug = NULL;
+    std::string result;
+
+    switch (GST_MESSAGE_TYPE (message))
+    {
+        case GST_MESSAGE_INFO:
+            gst_message_parse_info (message, &error, &debug);
+            break;
+        case GST_MESSAGE_WARNING:
+            gst_message_parse_warning (message, &error, &debug);
+            break;
+        case GST_MESSAGE_ERROR:
+            gst_message_parse_error (message, &error, &debug);
+            break;
+        default:
+            g_warning ("unexpected message type");
+    }
+
+    if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR)
+    {
+        result = error ? error->message : "unknown error";
+        if (debug)
+            result = result + "\n" + debug;
+    }
+    else
+    {
+        if (error)
+            g_printerr ("%s\n", error->message);
+        if (debug)
+            g_printerr ("%s\n", debug);
+    }
+
+    g_clear_error (&error);
+    g_free (debug);
+    return result;
+}
+
+bool link_audio_pad (GstPad *pad, GstElement *element)
+{
+    GstCaps *caps = gst_pad_query_caps (pad, NULL);
+    GstStructure *structure = gst_caps_get_structure (caps, 0);
+    bool audio = g_str_has_prefix (gst_structure_get_name (structure), "audio/");
+    gst_caps_unref (caps);
+
+    if (!audio)
+        return false;
+
+    GstPad *sink_pad = gst_element_get_static_pad (element, "sink");
+    GstPadLinkReturn ret = gst_pad_link (pad, sink_pad);
+    gst_object_unref (sink_pad);
+
+    if (ret != GST_PAD_LINK_OK)
+        throw std::runtime_error ("unable to link pad");
+    return true;
+}
+
+Analyzer::Analyzer ()
+    : m_element (gst_element_factory_make ("spectrum", 0))
+{
+    if (!m_element)
+        throw std::runtime_error ("the spectrum element is not installed");
+    gst_object_ref_sink (m_element);
+}
+
+Analyzer::~Analyzer ()
+{
+    gst_object_unref (m_element);
+}
+
+void Analyzer::configure (int bands, GstClockTime interval, double threshold)
+{
+    g_object_set (m_element,
+                  "post-messages", TRUE,
+                  "interval", static_cast<guint64>(interval),
+                  "threshold", static_cast<int>(threshold),
+                  "bands", bands,
+                  NULL);
+}
+
+// example data:
+// spectrum, endtime=(guint64)189252222222, timestamp=(guint64)189152222222,
+// stream-time=(guint64)189152222222, running-time=(guint64)189152222222,
+// duration=(guint64)100000000, magnitude=(float){ -36.146251678466797,
+// -22.013933181762695, -27.303266525268555, -39.544231414794922,
+// ... -60, -60 };
+bool Analyzer::dispatch (const GstStructure *structure, ColumnSink &sink)
+{
+    if (!gst_structure_has_name (structure, "spectrum"))
+        return false;
+
+    GstClockTime timestamp = GST_CLOCK_TIME_NONE;
+    gst_structure_get_clock_time (structure, "timestamp", &timestamp);
+
+    const GValue *val = gst_structure_get_value (structure, "magnitude");
+    guint size = gst_value_list_get_size (val);
+    m_levels.resize (size);
+    for (guint i = 0; i < size; ++i)
+        m_levels[i] = g_value_get_float (gst_value_list_get_value (val, i));
+
+    sink.on_column (timestamp, m_levels);
+    return true;
+}
+
+Renderer::Renderer (int width, int height, Style style, double threshold)
+    : m_surface (Cairo::ImageSurface::create (style == INVERTED ?
+                                              Cairo::FORMAT_RGB24 :
+                                              Cairo::FORMAT_ARGB32,
+                                              width, height))
+    , m_style (style)
+    , m_threshold (threshold)
+{
+    if (m_style == INVERTED)
+    {
+        Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create (m_surface);
+        cr->set_source_rgb (1.0, 1.0, 1.0);
+        cr->paint ();
+    }
+}
+
+void Renderer::paint_column (int x, const std::vector<float> &levels)
+{
+    int height = m_surface->get_height ();
+    int n = std::min (static_cast<int>(levels.size ()), height);
+
+    if (x < 0 || x >= m_surface->get_width () || n == 0)
+        return;
+
+    m_surface->flush ();
+    int stride = m_surface->get_stride ();
+    guint8 *bottom = m_surface->get_data () + (height - 1) * stride +
+        x * sizeof (guint32);
+    if (m_style == INVERTED)
+        spectral_paint_column_inverted (&levels[0], n, m_threshold, bottom, stride);
+    else
+        spectral_paint_column_alpha (&levels[0], n, m_threshold, bottom, stride);
+    m_surface->mark_dirty ();
+}
+
+Encoder::Encoder (const std::string &filename)
+    : m_filename (filename)
+{
+}
+
+void Encoder::write (const Cairo::RefPtr<Cairo::ImageSurface> &surface) const
+{
+    surface->write_to_png (m_filename);
+}
+
+}
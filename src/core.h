@@ -0,0 +1,133 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#ifndef SOUNDPRINT_CORE_H
+#define SOUNDPRINT_CORE_H
+
+#include <cairomm/cairomm.h>
+#include <glibmm.h>
+#include <gst/gst.h>
+#include <string>
+#include <vector>
+
+// The pieces soundprint and sonogen have in common: decoded audio goes
+// through an Analyzer, which hands one column of levels per interval to a
+// ColumnSink; the tools paint the columns with a Renderer and save the
+// result with an Encoder.  The shading itself is done by the kernels in
+// spectral.h, which the spectrogram plugin shares.
+namespace soundprint
+{
+
+class OptionEntry : public Glib::OptionEntry
+{
+public:
+    OptionEntry (const Glib::ustring &long_name = Glib::ustring(),
+                 const Glib::ustring &description = Glib::ustring());
+    OptionEntry (gchar short_name,
+                 const Glib::ustring &long_name = Glib::ustring(),
+                 const Glib::ustring &description = Glib::ustring());
+};
+
+// Prints INFO and WARNING messages to stderr.  An ERROR message is not
+// printed but described in the returned string, for the caller to fail
+// with; for everything else the string is empty.
+std::string report_message (GstMessage *message);
+
+// Links a pad of a decoder to the sink pad of element when it carries
+// audio.  Returns false for other pads and throws std::runtime_error when
+// linking fails.
+bool link_audio_pad (GstPad *pad, GstElement *element);
+
+class ColumnSink
+{
+public:
+    virtual ~ColumnSink () {}
+
+    // levels are in dB, lowest frequency band first
+    virtual void on_column (GstClockTime timestamp,
+                            const std::vector<float> &levels) = 0;
+};
+
+// A spectrum element posting one message per column interval, and the
+// conversion of its messages into columns
+class Analyzer
+{
+public:
+    Analyzer ();
+    ~Analyzer ();
+
+    // the element to put into the pipeline
+    GstElement *element () const { return m_element; }
+
+    void configure (int bands, GstClockTime interval, double threshold);
+
+    // hands the column in a spectrum message to sink; returns false for
+    // structures that are not spectrum messages
+    bool dispatch (const GstStructure *structure, ColumnSink &sink);
+
+private:
+    Analyzer (const Analyzer&);
+    Analyzer &operator= (const Analyzer&);
+
+    GstElement *m_element;
+    std::vector<float> m_levels;
+};
+
+// Paints columns into an image surface, lowest band at the bottom
+class Renderer
+{
+public:
+    enum Style
+    {
+        // dark on white, for thumbnails
+        INVERTED,
+        // black with the level in alpha, to composite over a background
+        ALPHA
+    };
+
+    Renderer (int width, int height, Style style, double threshold);
+
+    const Cairo::RefPtr<Cairo::ImageSurface> &surface () const { return m_surface; }
+
+    // bands beyond the height of the surface are dropped
+    void paint_column (int x, const std::vector<float> &levels);
+
+private:
+    Cairo::RefPtr<Cairo::ImageSurface> m_surface;
+    Style m_style;
+    float m_threshold;
+};
+
+class Encoder
+{
+public:
+    explicit Encoder (const std::string &filename);
+
+    // writes surface as a PNG; throws when that fails
+    void write (const Cairo::RefPtr<Cairo::ImageSurface> &surface) const;
+
+private:
+    std::string m_filename;
+};
+
+}
+
+#endif // SOUNDPRINT_CORE_H
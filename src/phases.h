@@ -0,0 +1,156 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#ifndef SOUNDPRINT_PHASES_H
+#define SOUNDPRINT_PHASES_H
+
+#include <glib.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include "trace.h"
+
+// The p-th percentile of sorted microseconds, in milliseconds
+inline double percentile (const std::vector<gint64> &sorted, int p)
+{
+    size_t rank = (sorted.size () * p + 99) / 100;
+    return sorted[rank ? rank - 1 : 0] / 1000.0;
+}
+
+// Splits one run of a tool into phases.  mark() ends the current phase and
+// charges it the time since the previous mark; work that is interleaved
+// with a phase (shading while decoding, say) can be charged separately with
+// add(), and is then left out of the enclosing phase.  With a trace set,
+// every mark also becomes a span in the trace.
+class PhaseTimer
+{
+public:
+    typedef std::vector<std::pair<std::string, gint64> > Phases;
+
+    PhaseTimer ()
+        : m_last (g_get_monotonic_time ())
+        , m_nested (0)
+        , m_trace (0)
+    {}
+
+    void set_trace (TraceWriter *trace) { m_trace = trace; }
+
+    void mark (const std::string &phase)
+    {
+        gint64 now = g_get_monotonic_time ();
+        charge (phase, now - m_last - m_nested);
+        if (m_trace)
+            m_trace->complete ("phase", phase, m_last, now);
+        m_last = now;
+        m_nested = 0;
+    }
+
+    void add (const std::string &phase, gint64 usecs)
+    {
+        charge (phase, usecs);
+        m_nested += usecs;
+    }
+
+    // microseconds per phase, in the order the phases were first seen
+    const Phases &phases () const { return m_phases; }
+
+private:
+    void charge (const std::string &phase, gint64 usecs)
+    {
+        for (Phases::iterator it = m_phases.begin (); it != m_phases.end (); ++it)
+        {
+            if (it->first == phase)
+            {
+                it->second += usecs;
+                return;
+            }
+        }
+        m_phases.push_back (std::make_pair (phase, usecs));
+    }
+
+    gint64 m_last;
+    gint64 m_nested;
+    Phases m_phases;
+    TraceWriter *m_trace;
+};
+
+// Collects the phases of the runs of a benchmark and prints their mean and
+// percentiles
+class PhaseStats
+{
+public:
+    void add (const PhaseTimer &timer)
+    {
+        const PhaseTimer::Phases &phases = timer.phases ();
+        gint64 total = 0;
+
+        for (PhaseTimer::Phases::const_iterator it = phases.begin ();
+             it != phases.end (); ++it)
+        {
+            samples (it->first).push_back (it->second);
+            total += it->second;
+        }
+        m_totals.push_back (total);
+    }
+
+    void print () const
+    {
+        g_print ("%-16s %10s %10s %10s %10s\n",
+                 "phase (ms)", "mean", "p50", "p90", "p99");
+        for (Samples::const_iterator it = m_samples.begin ();
+             it != m_samples.end (); ++it)
+            print_row (it->first, it->second);
+        print_row ("total", m_totals);
+    }
+
+private:
+    typedef std::vector<std::pair<std::string, std::vector<gint64> > > Samples;
+
+    std::vector<gint64> &samples (const std::string &phase)
+    {
+        for (Samples::iterator it = m_samples.begin (); it != m_samples.end (); ++it)
+            if (it->first == phase)
+                return it->second;
+        m_samples.push_back (std::make_pair (phase, std::vector<gint64> ()));
+        return m_samples.back ().second;
+    }
+
+    static void print_row (const std::string &phase, std::vector<gint64> values)
+    {
+        if (values.empty ())
+            return;
+
+        std::sort (values.begin (), values.end ());
+        double sum = 0.0;
+        for (size_t i = 0; i < values.size (); ++i)
+            sum += values[i];
+
+        g_print ("%-16s %10.3f %10.3f %10.3f %10.3f\n", phase.c_str (),
+                 sum / values.size () / 1000.0, percentile (values, 50),
+                 percentile (values, 90), percentile (values, 99));
+    }
+
+    Samples m_samples;
+    std::vector<gint64> m_totals;
+};
+
+#endif // SOUNDPRINT_PHASES_H
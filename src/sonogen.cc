@@ -27,6 +27,12 @@
 #endif
 
 #include <gst/gst.h>
+#include <map>
+#include <vector>
+#include "busmonitor.h"
+#include "core.h"
+#include "phases.h"
+#include "trace.h"
 
 const double DEFAULT_HEIGHT = 200.0;
 const double DEFAULT_WIDTH = 0.0;
@@ -37,6 +43,12 @@ const double DEFAULT_MAX_FREQUENCY = 12000;
 const char * DEFAULT_OUTPUT_FILENAME = "sonogram.png";
 const bool DEFAULT_DRAW_GRID = false;
 
+// with --overview, the most columns painted from each snippet
+const int OVERVIEW_SNIPPET_COLUMNS = 4;
+const double OVERVIEW_HATCH_SPACING = 6.0;
+// the closest the time axis markers get to each other
+const double GRID_MIN_MARKER_SPACING = 4.0;
+
 const double GRID_MARKER_LARGE = 6.0;
 const double GRID_MARKER_MED = 4.0;
 const double GRID_MARKER_SMALL = 2.0;
@@ -46,15 +58,18 @@ const int FONT_SIZE = 7;
 const char* FONT_FAMILY = "monospace";
 
 using Glib::ustring;
+using soundprint::OptionEntry;
 
-static const char* format(const char* fmt, ...)
+static std::string format(const char* fmt, ...)
 {
-    static char m_buf[255];
     va_list argp;
     va_start(argp, fmt);
-    g_vsnprintf(m_buf, sizeof(m_buf), fmt, argp);
+    gchar *buf = g_strdup_vprintf(fmt, argp);
     va_end(argp);
-    return m_buf;
+
+    std::string result(buf);
+    g_free(buf);
+    return result;
 }
 
 typedef enum {
@@ -65,6 +80,15 @@ typedef enum {
     STATE_DONE
 } AppState;
 
+// the benchmark phase that ends when a state is left
+static const char *state_phases[] = {
+    "preroll",
+    "duration",
+    "seek",
+    "decode+fft",
+    "draw"
+};
+
 // helper class to avoid mis-matched save()/restore() pairs.  Rely on scoping to
 // restore the context to the previously-saved graphics state. Also makes things
 // safer in the presence of exceptions / early returns.
@@ -84,25 +108,6 @@ struct ContextGuard
     Cairo::RefPtr<Cairo::Context> m_cr;
 };
 
-class OptionEntry : public Glib::OptionEntry
-{
-public:
-    OptionEntry (const ustring &long_name = ustring(),
-                 const ustring &description = ustring())
-    {
-        set_long_name (long_name);
-        set_description (description);
-    }
-    OptionEntry (gchar short_name,
-                 const ustring &long_name = ustring(),
-                 const ustring &description = ustring())
-    {
-        set_short_name (short_name);
-        set_long_name (long_name);
-        set_description (description);
-    }
-};
-
 struct AppOptions
 {
     AppOptions()
@@ -115,6 +120,9 @@ struct AppOptions
           , max_frequency (DEFAULT_MAX_FREQUENCY)
           , draw_grid (DEFAULT_DRAW_GRID)
           , benchmark (0)
+          , max_backlog (0)
+          , sync_render (false)
+          , overview (0)
           {}
 
     double height;
@@ -126,6 +134,10 @@ struct AppOptions
     double max_frequency;
     bool draw_grid;
     int benchmark;
+    std::string trace_file;
+    int max_backlog;
+    bool sync_render;
+    int overview;
 };
 
 class AppOptionGroup : public Glib::OptionGroup
@@ -167,6 +179,18 @@ public:
         add_entry (OptionEntry ("benchmark",
                                 "Run the specified number of times and report average time spent"),
                    m_options.benchmark);
+        add_entry_filename (OptionEntry ("trace",
+                                         "Write a Chrome trace of the run to this file"),
+                            m_options.trace_file);
+        add_entry (OptionEntry ("max-backlog",
+                                "Block decoding while this many spectrum messages wait (default unlimited)"),
+                   m_options.max_backlog);
+        add_entry (OptionEntry ("sync-render",
+                                "Paint spectrum columns on the streaming thread instead of the main loop"),
+                   m_options.sync_render);
+        add_entry (OptionEntry ("overview",
+                                "Only decode this many evenly spaced snippets of the file"),
+                   m_options.overview);
     }
 
     AppOptions m_options;
@@ -189,7 +213,12 @@ ends before the width is reached.\n\n\
 Note: the height and width only specifies the dimensions of\n\
 the sonogram.  If the -g option is used to draw a grid, the size\n\
 of the generated image will be expanded to accomodate the\n\
-axes and grid.";
+axes and grid.\n\n\
+Note: with '--overview N', only N short snippets spread evenly over\n\
+the file are decoded, a few columns each, and the parts of the\n\
+sonogram in between are hatched in gray.  The width defaults to\n\
+eight columns per snippet and '--duration' is ignored; the\n\
+resolution applies within a snippet.";
 
 class OptionContext : public Glib::OptionContext
 {
@@ -206,7 +235,7 @@ public:
     AppOptionGroup m_option_group;
 };
 
-class App
+class App : public soundprint::ColumnSink
 {
 public:
     App (const std::string & filearg, AppOptions &options)
@@ -223,10 +252,19 @@ public:
     , m_duration (0)
     , m_peak_rms (options.noise_floor)
     , m_min_rms (options.noise_floor)
+    , m_renderer (0)
     , m_sample_no (0)
+    , m_next_column (0)
+    , m_snippet (0)
+    , m_snippet_columns (0)
     , m_prerolled (false)
     , m_fd(pango_font_description_new())
+    , m_trace (options.trace_file.empty () ? 0 : new TraceWriter ())
+    , m_shade_time (0)
+    , m_finishing (false)
     {
+        g_mutex_init (&m_error_lock);
+        m_phases.set_trace (m_trace);
         g_debug("%s", G_STRFUNC);
 #ifdef ENABLE_GIO
         Glib::RefPtr<Gio::File> f = Gio::File::create_for_commandline_arg(filearg);
@@ -240,6 +278,11 @@ public:
         m_fileuri = Glib::filename_to_uri(abspath);
 #endif
 
+        // an overview spreads its snippets over the whole file
+        m_options.overview = MAX(m_options.overview, 0);
+        if (m_options.overview)
+            m_options.duration = 0;
+
         if (m_options.duration && m_options.width)
         {
             m_options.resolution = m_options.width / m_options.duration;
@@ -257,10 +300,19 @@ public:
 
     ~App ()
     {
-        g_object_unref (m_bus);
-        g_object_unref (m_pipeline);
-        g_object_unref(m_decoder_pad);
+        if (m_bus)
+        {
+            gst_bus_remove_signal_watch (m_bus);
+            g_object_unref (m_bus);
+        }
+        if (m_pipeline)
+            g_object_unref (m_pipeline);
+        if (m_decoder_pad)
+            g_object_unref(m_decoder_pad);
         pango_font_description_free(m_fd);
+        delete m_renderer;
+        delete m_trace;
+        g_mutex_clear (&m_error_lock);
     }
 
     void reset_pipeline()
@@ -271,7 +323,10 @@ public:
 
         m_prerolled = false;
         /* restart at the beginning */
-        if (!gst_element_seek_simple(m_pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, 0)) {
+        m_bus_monitor.release ();
+        bool success = gst_element_seek_simple(m_pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, 0);
+        m_bus_monitor.rearm ();
+        if (!success) {
             throw std::runtime_error("Unable to seek to the beginning");
         }
         g_signal_connect (m_bus, "message::async-done",
@@ -288,16 +343,33 @@ public:
         g_debug("Total file duration is %g", seconds);
 
         if (!m_options.width)
-            m_options.width = num_samples;
+            m_options.width = m_options.overview ?
+                m_options.overview * 2 * OVERVIEW_SNIPPET_COLUMNS : num_samples;
+
+        if (m_options.overview)
+        {
+            if (m_options.overview > m_options.width)
+            {
+                g_warning("Only %g snippets fit into the width", m_options.width);
+                m_options.overview = static_cast<int>(m_options.width);
+            }
+            // about half of the picture is snippets, the rest is the gaps
+            // between them
+            m_snippet_columns = CLAMP(static_cast<int>(m_options.width) /
+                                      (2 * m_options.overview),
+                                      1, OVERVIEW_SNIPPET_COLUMNS);
+        }
+        m_painted.assign(static_cast<int>(m_options.width), false);
 
-        m_surface = Cairo::ImageSurface::create (Cairo::FORMAT_ARGB32,
-                                                 m_options.width,
-                                                 m_options.height);
+        m_renderer = new soundprint::Renderer (m_options.width, m_options.height,
+                                               soundprint::Renderer::ALPHA,
+                                               m_options.noise_floor);
+        m_surface = m_renderer->surface ();
         m_cr = Cairo::Context::create (m_surface);
 
         m_convert = gst_element_factory_make ("audioconvert", 0);
         gst_element_set_state(m_convert, GST_STATE_PAUSED);
-        m_spectrum = gst_element_factory_make ("spectrum", 0);
+        m_spectrum = m_analyzer.element ();
         gst_element_set_state(m_spectrum, GST_STATE_PAUSED);
         m_filter = gst_element_factory_make ("audiocheblimit", 0);
         gst_element_set_state(m_filter, GST_STATE_PAUSED);
@@ -326,9 +398,84 @@ public:
         if (!gst_element_link (m_filter, m_level)) throw std::runtime_error("Unable to link");
         if (!gst_element_link (m_level, m_sink)) throw std::runtime_error("Unable to link");
 
+        if (m_trace)
+        {
+            trace_pad (m_spectrum, "sink", "spectrum sink");
+            trace_pad (m_spectrum, "src", "spectrum src");
+        }
+
+        if (m_options.overview)
+        {
+            g_signal_connect (m_bus, "message::segment-done",
+                              G_CALLBACK (on_segment_done_proxy), this);
+            // seek while still paused, so nothing from before the first
+            // snippet gets analyzed
+            configure_analysis();
+            seek_snippet();
+        }
+
         start_pipeline();
     }
 
+    // Seeks to the current snippet of an overview.  Being a segment seek,
+    // the pipeline posts SEGMENT_DONE instead of EOS once the snippet is
+    // decoded; an accurate one, so the snippet starts where its columns
+    // say it does.
+    void seek_snippet()
+    {
+        g_debug("%s: snippet %i", G_STRFUNC, m_snippet);
+        GstClockTime start = snippet_start(m_snippet);
+
+        // half a column more, so the last interval is complete
+        GstClockTime length = (m_snippet_columns + 0.5) * GST_SECOND /
+            m_options.resolution;
+        GstSeekFlags flags = static_cast<GstSeekFlags>(GST_SEEK_FLAG_FLUSH |
+                                                       GST_SEEK_FLAG_SEGMENT |
+                                                       GST_SEEK_FLAG_ACCURATE);
+        m_bus_monitor.release ();
+        bool success = gst_element_seek (m_pipeline, 1.0, GST_FORMAT_TIME, flags,
+                                         GST_SEEK_TYPE_SET, start,
+                                         GST_SEEK_TYPE_SET, start + length);
+        m_bus_monitor.rearm ();
+        if (!success)
+            throw std::runtime_error(format("Unable to seek to snippet %i", m_snippet));
+    }
+
+    GstClockTime snippet_start(int snippet) const
+    {
+        return gst_util_uint64_scale_int (m_duration, snippet, m_options.overview);
+    }
+
+    int snippet_column(int snippet) const
+    {
+        return static_cast<int>(snippet * m_options.width / m_options.overview + 0.5);
+    }
+
+    static void on_segment_done_proxy (GstBus *,
+                                       GstMessage *,
+                                       gpointer user_data)
+    {
+        g_debug("%s", G_STRFUNC);
+        App *self = static_cast<App*>(user_data);
+        try {
+            self->on_segment_done ();
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
+    }
+
+    void on_segment_done ()
+    {
+        if (m_state != STATE_GENERATE)
+            return;
+
+        if (++m_snippet < m_options.overview)
+            seek_snippet();
+        else
+            state_done();
+    }
+
     void on_duration_changed(GstBus *bus, GstMessage *message)
     {
         g_debug("%s", G_STRFUNC);
@@ -352,6 +499,17 @@ public:
         if (!m_prerolled || !m_decoder_pad)
             throw std::runtime_error("Missing prerequisites for calculating duration");
 
+        // decoding the whole file to learn its length would defeat the
+        // point of an overview, so it has to trust the reported duration
+        if (m_options.overview)
+        {
+            if (!gst_element_query_duration(m_pipeline, GST_FORMAT_TIME, &m_duration) ||
+                m_duration <= 0)
+                throw std::runtime_error("Unable to query the duration for an overview");
+            state_done();
+            return;
+        }
+
         GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(m_pipeline));
             g_signal_connect (m_bus, "message::duration-changed",
                               G_CALLBACK (on_duration_changed_message_proxy), this);
@@ -368,11 +526,17 @@ public:
             throw std::runtime_error("Couldn't add element to pipeline");
     }
 
+    // Runs the job to completion on the calling thread, which may be any
+    // thread: everything is dispatched from a main context of the job's
+    // own.  Returns 0 on success and 1 on failure, with the reason in
+    // error().
     int run ()
     {
         g_debug("%s", G_STRFUNC);
+        m_context = Glib::MainContext::create();
+        g_main_context_push_thread_default (m_context->gobj ());
         try {
-            m_mainloop = Glib::MainLoop::create();
+            m_mainloop = Glib::MainLoop::create(m_context);
             m_pipeline = gst_pipeline_new (0);
             m_decoder = gst_element_factory_make ("uridecodebin", 0);
             m_sink = gst_element_factory_make ("fakesink", 0);
@@ -387,6 +551,14 @@ public:
             g_signal_connect (m_decoder, "pad-added",
                               G_CALLBACK (on_pad_added_proxy), this);
 
+            if (m_trace)
+            {
+                trace_pad (m_sink, "sink", "sink");
+            }
+            if (m_options.sync_render)
+                m_bus_monitor.set_sync_callback (on_sync_element_message, this);
+            m_bus_monitor.attach (m_bus, m_trace, MAX (m_options.max_backlog, 0));
+
             gst_bus_add_signal_watch (m_bus);
 
             g_signal_connect (m_bus, "message::eos",
@@ -400,6 +572,7 @@ public:
             g_signal_connect (m_bus, "message::element",
                               G_CALLBACK (on_element_message_proxy), this);
 
+            m_phases.mark ("setup");
             GstStateChangeReturn ret = gst_element_set_state (m_pipeline, GST_STATE_PAUSED);
             g_debug ("set_state return = %u", ret);
             m_prerolled = (ret == GST_STATE_CHANGE_SUCCESS);
@@ -418,26 +591,99 @@ public:
             m_mainloop->run ();
         } catch (std::exception &e)
         {
-            gst_element_set_state (m_pipeline, GST_STATE_NULL);
-            g_error ("%s", e.what ());
-            exit(1);
+            fail (e.what ());
+        }
+        g_main_context_pop_thread_default (m_context->gobj ());
+
+        if (!error ().empty ())
+        {
+            m_bus_monitor.release ();
+            if (m_pipeline)
+                gst_element_set_state (m_pipeline, GST_STATE_NULL);
+            return 1;
         }
+
+        if (m_trace && !m_trace->write (m_options.trace_file))
+            g_warning ("Unable to write trace to '%s'", m_options.trace_file.c_str ());
         return 0;
     }
 
+    // the first error that stopped the job
+    std::string error () const
+    {
+        g_mutex_lock (&m_error_lock);
+        std::string result = m_error;
+        g_mutex_unlock (&m_error_lock);
+        return result;
+    }
+
+    // records why the job failed and stops it; callable from any thread
+    void fail (const std::string &message)
+    {
+        g_mutex_lock (&m_error_lock);
+        if (m_error.empty ())
+            m_error = message.empty () ? "unknown error" : message;
+        g_mutex_unlock (&m_error_lock);
+
+        if (m_mainloop)
+            m_mainloop->quit ();
+    }
+
+    // continues with the next state on the job's main context, for callers
+    // on a streaming thread
+    void invoke_state_done ()
+    {
+        g_main_context_invoke (m_context->gobj (), on_state_done_proxy, this);
+    }
+
+    static gboolean on_state_done_proxy (gpointer user_data)
+    {
+        App *self = static_cast<App*>(user_data);
+        try {
+            self->state_done ();
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
+        return FALSE;
+    }
+
+    void trace_pad (GstElement *element, const char *pad_name,
+                    const std::string &name)
+    {
+        GstPad *pad = gst_element_get_static_pad (element, pad_name);
+        m_trace->probe_pad (pad, name);
+        gst_object_unref (pad);
+    }
+
     static void on_pad_added_proxy (GstElement *element,
                                     GstPad *pad,
                                     gpointer user_data)
     {
         g_debug("%s", G_STRFUNC);
         App *self = static_cast<App*>(user_data);
-        self->on_pad_added (element, pad);
+        try {
+            self->on_pad_added (element, pad);
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
     }
 
     bool start_pipeline ()
     {
         g_debug("%s", G_STRFUNC);
         GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(m_pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "start_pipeline");
+        configure_analysis();
+        gst_element_set_state (m_pipeline, GST_STATE_PLAYING);
+
+        return false;
+    }
+
+    // sets up the spectrum and level elements for the sampling rate of the
+    // decoded audio, once
+    void configure_analysis ()
+    {
         if (!m_sampling_rate)
         {
             GstCaps *caps = gst_pad_get_current_caps (m_decoder_pad);
@@ -458,14 +704,9 @@ public:
             // according to nyquist, max frequency is half the sampling rate...
             int num_bands = (m_sampling_rate / 2) / band_freq;
 
-            gint64 interval = GST_SECOND / m_options.resolution;
+            gint64 interval = GST_SECOND / m_options.resolution + 0.5;
             g_debug ("setting interval %li", interval);
-            g_object_set (m_spectrum,
-                          "post-messages", TRUE,
-                          "interval", interval,
-                          "threshold", static_cast<int>(m_options.noise_floor),
-                          "bands", num_bands,
-                          NULL);
+            m_analyzer.configure (num_bands, interval, m_options.noise_floor);
             g_object_set (m_level,
                           "message", TRUE,
                           "interval", interval / 2,
@@ -473,64 +714,27 @@ public:
                           "peak-ttl", 0,
                           NULL);
         }
-
-        gst_element_set_state (m_pipeline, GST_STATE_PLAYING);
-
-        return false;
     }
 
     void on_pad_added (GstElement *, GstPad *pad)
     {
         g_debug("%s", G_STRFUNC);
-        GstCaps *caps = gst_pad_query_caps (pad, NULL);
-        GstStructure *structure = gst_caps_get_structure (caps, 0);
-        const char *name = gst_structure_get_name (structure);
-
-        if (g_str_has_prefix (name, "audio/"))
-        {
-            m_decoder_pad = GST_PAD(g_object_ref(pad));
-            GstPad *sink_pad =
-                gst_element_get_static_pad (m_sink, "sink");
+        if (!soundprint::link_audio_pad (pad, m_sink))
+            return;
 
-            if (!gst_pad_link (m_decoder_pad, sink_pad) == GST_PAD_LINK_OK)
-                throw std::runtime_error("unable to link pad");
+        m_decoder_pad = GST_PAD(g_object_ref(pad));
+        if (m_trace)
+            m_trace->probe_pad (m_decoder_pad, "decoder");
 
-            state_done();
-        }
-        gst_caps_unref (caps);
+        invoke_state_done();
     }
 
-    static void on_error_message (GstBus *, GstMessage *message, gpointer)
+    static void on_error_message (GstBus *, GstMessage *message, gpointer user_data)
     {
         g_debug("%s", G_STRFUNC);
-        GError *error = NULL;
-        gchar *debug = NULL;
-
-        switch (message->type)
-        {
-            case GST_MESSAGE_INFO:
-                gst_message_parse_info (message, &error, &debug);
-                break;
-            case GST_MESSAGE_WARNING:
-                gst_message_parse_warning (message, &error, &debug);
-                break;
-            case GST_MESSAGE_ERROR:
-                gst_message_parse_error (message, &error, &debug);
-                break;
-            default:
-                g_warning ("unexpected message type");
-        }
-
-        if (error)
-            g_print ("%s", error->message);
-        if (debug)
-            g_print ("%s", debug);
-
-        if (message->type == GST_MESSAGE_ERROR)
-            throw std::runtime_error (debug);
-
-        g_clear_error (&error);
-        g_free (debug);
+        std::string error = soundprint::report_message (message);
+        if (!error.empty ())
+            static_cast<App*>(user_data)->fail (error);
     }
 
     static void on_eos_proxy (GstBus *,
@@ -539,11 +743,19 @@ public:
     {
         g_debug("%s", G_STRFUNC);
         App *self = static_cast<App*>(user_data);
-        self->state_done ();
+        try {
+            self->state_done ();
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
     }
 
     void change_state(AppState new_state)
     {
+        if (m_state == STATE_GENERATE)
+            m_phases.add ("shade", m_shade_time);
+        m_phases.mark (state_phases[m_state]);
         m_state = new_state;
         g_debug("%s: new state = %i", G_STRFUNC, m_state);
         char *filename = g_strdup_printf("state-%i", m_state);
@@ -587,11 +799,49 @@ public:
         }
     }
 
+    // Hatches the columns of an overview that no snippet was painted into,
+    // so that it can't be taken for a full analysis of the file
+    void hatch_unsampled()
+    {
+        ContextGuard guard(m_cr);
+        int width = m_painted.size();
+        for (int x = 0; x < width; )
+        {
+            if (m_painted[x])
+            {
+                ++x;
+                continue;
+            }
+            int end = x;
+            while (end < width && !m_painted[end])
+                ++end;
+            m_cr->rectangle(x, 0, end - x, m_options.height);
+            x = end;
+        }
+        m_cr->clip();
+
+        m_cr->set_source_rgba(0.5, 0.5, 0.5, 0.2);
+        m_cr->paint();
+        m_cr->set_source_rgba(0.5, 0.5, 0.5, 0.6);
+        m_cr->set_line_width(1.0);
+        for (double x = -m_options.height; x < width; x += OVERVIEW_HATCH_SPACING)
+        {
+            m_cr->move_to(x, m_options.height);
+            m_cr->line_to(x + m_options.height, 0);
+        }
+        m_cr->stroke();
+    }
+
     void draw_sonogram()
     {
         try {
             g_debug("%s", G_STRFUNC);
+            m_bus_monitor.release ();
             gst_element_set_state (m_pipeline, GST_STATE_NULL);
+            m_phases.mark ("teardown");
+
+            if (m_options.overview)
+                hatch_unsampled();
 
             Cairo::RefPtr<Cairo::ImageSurface> graph;
             if (m_options.draw_grid)
@@ -606,7 +856,7 @@ public:
                     // measure width of frequency text
                     PangoLayout* layout = pango_cairo_create_layout(m_cr->cobj());
                     pango_layout_set_font_description(layout, m_fd);
-                    pango_layout_set_text(layout, format("%fk", nKhz), -1);
+                    pango_layout_set_text(layout, format("%fk", nKhz).c_str(), -1);
                     PangoRectangle logical_extents;
                     pango_layout_get_extents(layout, NULL, &logical_extents);
                     double w = logical_extents.width / PANGO_SCALE;
@@ -617,13 +867,29 @@ public:
                     // now measure text for level (dB) axis
                     layout = pango_cairo_create_layout(m_cr->cobj());
                     pango_layout_set_font_description(layout, m_fd);
-                    pango_layout_set_text(layout, format("%fdB", m_options.noise_floor), -1);
+                    pango_layout_set_text(layout, format("%fdB", m_options.noise_floor).c_str(), -1);
                     pango_layout_get_extents(layout, NULL, &logical_extents);
                     w = logical_extents.width / PANGO_SCALE;
                     borderL = std::max(GRID_MARKER_SMALL + w + GRID_MARKER_SMALL + GRID_MARKER_LARGE, borderL);
                 }
 
-                int seconds = static_cast<int>(m_options.width / m_options.resolution);
+                // an overview fits the whole file into its width, so its
+                // time axis marks minutes or hours rather than every second
+                double px_per_second = m_options.resolution;
+                int step = 1;
+                if (m_options.overview)
+                {
+                    static const int steps[] = { 1, 10, 60, 600, 3600 };
+                    px_per_second = m_options.width * GST_SECOND / m_duration;
+                    for (size_t i = 0; i < G_N_ELEMENTS(steps); ++i)
+                    {
+                        step = steps[i];
+                        if (step * px_per_second >= GRID_MIN_MARKER_SPACING)
+                            break;
+                    }
+                }
+
+                int seconds = static_cast<int>(m_options.width / px_per_second);
                 double w = borderL + m_options.width;
                 // draw emplitide below sonograph, witha  much smaller height. Add
                 // borderB space between them
@@ -691,7 +957,7 @@ public:
                         {
                             PangoLayout* layout = pango_cairo_create_layout(cr->cobj());
                             pango_layout_set_font_description(layout, m_fd);
-                            pango_layout_set_text(layout, format("%ik", f), -1);
+                            pango_layout_set_text(layout, format("%ik", f).c_str(), -1);
                             PangoRectangle extents;
                             pango_layout_get_extents(layout, NULL, &extents);
                             double w = extents.width / PANGO_SCALE;
@@ -709,23 +975,23 @@ public:
                     // draw a line every second
                     {
                         ContextGuard guard(cr);
-                        for (int s = 1; s <= seconds; s++)
+                        for (int s = step; s <= seconds; s += step)
                         {
                             ContextGuard gIter(cr);
                             double markerSize = GRID_MARKER_MED;
-                            if (s % 5 == 0)
+                            if ((s / step) % 5 == 0)
                                 markerSize = GRID_MARKER_LARGE;
 
                             // draw text every N marks
                             int textN = 1;
-                            if (m_options.resolution <= 10)
+                            if (px_per_second * step <= 10)
                                 textN = 10;
-                            else if (m_options.resolution <= 30)
+                            else if (px_per_second * step <= 30)
                                 textN = 5;
 
-                            bool drawText = (s % textN) == 0;
+                            bool drawText = ((s / step) % textN) == 0;
 
-                            int x = static_cast<int>(m_options.resolution * s);
+                            int x = static_cast<int>(px_per_second * s);
                             cr->move_to (x, -markerSize);
                             cr->line_to (x, 0);
                             cr->stroke();
@@ -734,7 +1000,7 @@ public:
                             {
                                 PangoLayout* layout = pango_cairo_create_layout(cr->cobj());
                                 pango_layout_set_font_description(layout, m_fd);
-                                pango_layout_set_text(layout, format("%is", s), -1);
+                                pango_layout_set_text(layout, format("%is", s).c_str(), -1);
                                 PangoRectangle extents;
                                 pango_layout_get_extents(layout, NULL, &extents);
                                 double w = extents.width / PANGO_SCALE;
@@ -817,7 +1083,7 @@ public:
                         {
                             PangoLayout* layout = pango_cairo_create_layout(cr->cobj());
                             pango_layout_set_font_description(layout, m_fd);
-                            pango_layout_set_text(layout, format("%idB", l), -1);
+                            pango_layout_set_text(layout, format("%idB", l).c_str(), -1);
                             PangoRectangle extents;
                             pango_layout_get_extents(layout, NULL, &extents);
                             double w = extents.width / PANGO_SCALE;
@@ -853,144 +1119,149 @@ public:
                 cr->paint();
             }
 
-            graph->write_to_png (m_options.output_file);
+            m_phases.mark ("grid");
+            soundprint::Encoder (m_options.output_file).write (graph);
+            m_phases.mark ("png");
         }
         catch(const std::exception& e)
         {
-            g_warning("Unable to finish '%s': %s", m_options.output_file.c_str(), e.what());
-            exit(1);
+            fail (format ("Unable to finish '%s': %s", m_options.output_file.c_str(), e.what()));
         }
     }
 
     static void on_element_message_proxy (GstBus *bus,
                                           GstMessage *message,
                                           gpointer user_data)
+    {
+        App *self = static_cast<App*>(user_data);
+        self->m_bus_monitor.delivered (message);
+
+        const GstStructure *structure = gst_message_get_structure (message);
+        try {
+            if (self->m_analyzer.dispatch (structure, *self))
+                return;
+            if (gst_structure_has_name (structure, "level"))
+                self->on_level (bus, structure);
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
+    }
+
+    // handles spectrum and level messages on the streaming thread that
+    // posted them
+    static bool on_sync_element_message (GstMessage *message,
+                                         gpointer user_data)
     {
         App *self = static_cast<App*>(user_data);
         const GstStructure *structure = gst_message_get_structure (message);
-        if (gst_structure_has_name (structure, "spectrum"))
-            self->on_spectrum (bus, structure);
-        else if (gst_structure_has_name (structure, "level"))
-            self->on_level (bus, structure);
+        try {
+            if (self->m_analyzer.dispatch (structure, *self))
+                return true;
+            if (!gst_structure_has_name (structure, "level"))
+                return false;
+            self->on_level (0, structure);
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
+        return true;
     }
 
-    // example data:
-    // spectrum, endtime=(guint64)189252222222, timestamp=(guint64)189152222222,
-    // stream-time=(guint64)189152222222, running-time=(guint64)189152222222,
-    // duration=(guint64)100000000, magnitude=(float){ -36.146251678466797,
-    // -22.013933181762695, -27.303266525268555, -39.544231414794922,
-    // -47.111648559570312, -48.796600341796875, -51.38055419921875,
-    // -52.118595123291016, -48.332794189453125, -50.224254608154297,
-    // -54.032829284667969, -47.853244781494141, -48.721431732177734,
-    // -54.715785980224609, -53.286895751953125, -57.693508148193359,
-    // -59.937911987304688, -59.571735382080078, -57.537551879882812,
-    // -58.367549896240234, -59.908416748046875, -59.729766845703125, -60, -60,
-    // -60, -59.997806549072266, -59.669063568115234, -58.566783905029297,
-    // -57.596271514892578, -57.8333740234375, -59.022228240966797,
-    // -59.885730743408203, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60 };
-
-    void paint_spectrum_at_offset(const GValue *val, int offset)
+    // Ends the generate state once the picture is full.  On the streaming
+    // thread that has to happen on the main loop, and nothing may be
+    // painted after asking for it, since the main loop is about to draw the
+    // picture.
+    void finish_generating ()
     {
-        int size = gst_value_list_get_size (val);
-        int i;
-
-        if (m_options.height < size)
-            size = m_options.height;
-
-        // the inflection point between the two halves of the alpha formula
-        const float TX = 0.6;
-        const float TY = 0.85;
-        // multiplier for the first segment
-        const float k = (1 / TX) * (1 / TX) * TY;
-        // slope and offset of the second segment
-        static const float m = (1.0 - TY) / (1.0 - TX);
-        static const float b = TY - m * TX;
-        unsigned char *data = m_surface->get_data ();
-        const int stride = m_surface->format_stride_for_width (Cairo::FORMAT_ARGB32, m_options.width);
-
-        m_surface->flush ();
-        for (i = 0; i < size; ++i)
+        if (!m_options.sync_render)
         {
-            const GValue *floatval = gst_value_list_get_value (val, i);
-            float v = g_value_get_float (floatval);
-            double shade = (v - m_options.noise_floor) / std::abs(m_options.noise_floor);
-            if (shade > 0.0)
-            {
-                unsigned char *pixel = data + ((static_cast<int>(m_options.height) - 1 - i) * stride) +
-                    offset * sizeof (guint32);
-                // Try to decrease the background noise a bit while making the
-                // foreground noise stand out a bit better.  From 0 to T, we
-                // use a parabolic (squared) slope to de-emphasize the lower
-                // levels, and from T and up, we simply map the aplitude
-                // directly to the alpha.
-                if (shade < TX)
-                {
-                    shade = k * shade * shade;
-                }
-                else
-                {
-                    shade = m * shade + b;
-                }
+            state_done ();
+            return;
+        }
 
-                // clamp value betwen 0.0 and 1.0, just in case
-                unsigned int byte = (std::max (0.0, std::min (1.0, shade)) * 0xFF);
+        if (m_finishing)
+            return;
+        m_finishing = true;
+        invoke_state_done ();
+    }
 
-                memset (pixel, 0x0, sizeof (guint32));
-                pixel[3] = byte;
-            }
-        }
-        m_surface->mark_dirty ();
+    void paint_spectrum_at_offset(const std::vector<float> &levels, int offset)
+    {
+        gint64 start = g_get_monotonic_time ();
+        m_renderer->paint_column (offset, levels);
+        m_painted[offset] = true;
+
+        gint64 end = g_get_monotonic_time ();
+        m_shade_time += end - start;
+        if (m_trace && m_sample_no % TRACE_COLUMN_INTERVAL == 0)
+            m_trace->complete ("paint", "paint column", start, end,
+                               format ("{\"column\":%i}", offset));
         ++m_sample_no;
     }
 
-    void on_spectrum (GstBus *, const GstStructure *structure)
+    void on_column (GstClockTime timestamp, const std::vector<float> &levels)
     {
-        const GValue *vtimestamp = gst_structure_get_value (structure, "endtime");
-        double seconds = static_cast<double>(g_value_get_uint64(vtimestamp)) / GST_SECOND;
-        static int n = 0;
-        if (!m_cr)
+        if (!m_renderer || m_finishing)
+            return;
+
+        if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+            return;
+
+        if (m_options.overview)
         {
-            //g_debug("got 'spectrum' message before duration: %s", gst_structure_to_string(structure));
+            // The snippet follows from the timestamp alone: with
+            // --sync-render this runs on the streaming thread while the main
+            // loop seeks to the next snippet.  Its columns count from where
+            // it starts, and whatever is decoded past them is dropped.
+            int snippet = static_cast<int>(
+                gst_util_uint64_scale (timestamp, m_options.overview, m_duration));
+            if (snippet_start(snippet + 1) <= timestamp)
+                ++snippet;
+            if (snippet >= m_options.overview)
+                return;
+            int first = snippet_column(snippet);
+            int column = first +
+                static_cast<int>((timestamp - snippet_start(snippet)) *
+                                 m_options.resolution / GST_SECOND + 0.5);
+            if (column >= first + m_snippet_columns || column >= m_options.width)
+                return;
+            if (m_painted[column])
+            {
+                g_debug("column %i was already painted", column);
+                return;
+            }
+            paint_spectrum_at_offset(levels, column);
             return;
         }
-        //g_debug("got spectrum message %i @ %g seconds", n++, seconds); 
 
-        static int last_px = -1;
-        int pixel_offset = (seconds  * m_options.resolution);
-        if (pixel_offset >= m_options.width)
+        // The spectrum element frames its intervals in whole samples, so
+        // the first sample of an interval rounds to the column it belongs
+        // to even when a column is a fractional number of samples wide.
+        guint64 sample = gst_util_uint64_scale_round (timestamp, m_sampling_rate,
+                                                      GST_SECOND);
+        int column = static_cast<int>(sample * m_options.resolution /
+                                      m_sampling_rate + 0.5);
+
+        if (column >= m_options.width)
         {
-            state_done();
+            finish_generating ();
             return;
         }
-        if (pixel_offset == last_px)
+        if (column < m_next_column)
         {
-            //jitter probably caused the message to fall on the previous pixel
-            //offset, so just draw it at the next one
-            pixel_offset++;
+            g_debug("column %i was already painted", column);
+            return;
         }
-
-        if (pixel_offset - last_px > 1)
-            g_debug("skipped pixels between %i and %i", last_px, pixel_offset);
-
-        const GValue *val = gst_structure_get_value (structure, "magnitude");
-        if (last_px != -1)
+        if (column > m_next_column)
         {
-            // paint columns that were missed due to jitter with the current
-            // magnitude just to avoid blank spots in the spectrogram
-            for (int i = last_px + 1; i < pixel_offset; i++)
-            {
-                paint_spectrum_at_offset(val, i);
-            }
+            // only lost messages leave gaps; they stay empty rather than
+            // show audio from another interval
+            g_warning("no spectrum for columns %i to %i", m_next_column, column - 1);
         }
-        paint_spectrum_at_offset(val, pixel_offset);
-        last_px = pixel_offset;
+
+        paint_spectrum_at_offset(levels, column);
+        m_next_column = column + 1;
     }
 
     /* example data:
@@ -1003,6 +1274,9 @@ public:
      */
     void on_level (GstBus *, const GstStructure *structure)
     {
+        if (m_finishing)
+            return;
+
         const GValue *vtimestamp = gst_structure_get_value (structure, "timestamp");
         double seconds = static_cast<double>(g_value_get_uint64(vtimestamp)) / GST_SECOND;
         const GValue *vrms = gst_structure_get_value(const_cast<GstStructure*>(structure), "rms");
@@ -1035,7 +1309,12 @@ public:
     {
         g_debug("%s", G_STRFUNC);
         App *self = static_cast<App*>(user_data);
-        self->on_async_done (bus, message);
+        try {
+            self->on_async_done (bus, message);
+        } catch (std::exception &e)
+        {
+            self->fail (e.what ());
+        }
     }
 
     void on_async_done (GstBus *, GstMessage *)
@@ -1048,6 +1327,8 @@ public:
                                               this);
     }
 
+    const PhaseTimer &phases () const { return m_phases; }
+    const BusMonitor &bus_monitor () const { return m_bus_monitor; }
 
 private:
     Glib::RefPtr<Glib::MainLoop> m_mainloop;
@@ -1072,12 +1353,26 @@ private:
     double m_peak_rms;
     double m_min_rms;
     std::map<double, double> m_levels;
+    soundprint::Analyzer m_analyzer;
+    soundprint::Renderer *m_renderer;
     Cairo::RefPtr<Cairo::ImageSurface> m_surface;
     Cairo::RefPtr<Cairo::Context> m_cr;
 
     int m_sample_no;
+    int m_next_column;
+    std::vector<bool> m_painted;
+    int m_snippet;
+    int m_snippet_columns;
     bool m_prerolled;
     PangoFontDescription* m_fd;
+    PhaseTimer m_phases;
+    TraceWriter *m_trace;
+    gint64 m_shade_time;
+    bool m_finishing;
+    Glib::RefPtr<Glib::MainContext> m_context;
+    mutable GMutex m_error_lock;
+    std::string m_error;
+    BusMonitor m_bus_monitor;
 };
 
 int main (int argc, char** argv)
@@ -1090,7 +1385,9 @@ int main (int argc, char** argv)
     try
     {
         OptionContext octx;
+        gint64 init_start = g_get_monotonic_time ();
         octx.parse (argc, argv);
+        gint64 init_time = g_get_monotonic_time () - init_start;
 
         if (argc != 2)
         {
@@ -1103,29 +1400,46 @@ int main (int argc, char** argv)
         if (iterations > 0)
         {
             Glib::Timer timer;
+            PhaseStats stats;
+            BusStats bus_stats;
             for (int i = 0; i < octx.m_option_group.m_options.benchmark; ++i)
             {
                 App app (argv[1], octx.m_option_group.m_options);
-                app.run();
+                if (app.run() != 0)
+                {
+                    g_printerr ("%s\n", app.error ().c_str ());
+                    return 1;
+                }
+                stats.add (app.phases ());
+                bus_stats.add (app.bus_monitor ());
                 g_print (".");
             }
             double elapsed = timer.elapsed ();
             g_print ("\nTotal time elepased: %g\n", elapsed);
             g_print ("Mean iteration time: %g\n", elapsed / iterations);
+            g_print ("GStreamer init: %.3f ms\n\n", init_time / 1000.0);
+            stats.print ();
+            bus_stats.print ();
         }
         else
         {
             App app (argv[1], octx.m_option_group.m_options);
-            return app.run();
+            if (app.run() != 0)
+            {
+                g_printerr ("%s\n", app.error ().c_str ());
+                return 1;
+            }
         }
     }
     catch (std::exception &e)
     {
-        g_error ("%s", e.what ());
+        g_printerr ("%s\n", e.what ());
+        return 1;
     }
     catch (Glib::Error &e)
     {
-        g_error ("%s", e.what ().c_str ());
+        g_printerr ("%s\n", e.what ().c_str ());
+        return 1;
     }
-    exit(1);
+    return 0;
 }
@@ -22,6 +22,11 @@
 #include <cairomm/cairomm.h>
 #include <glibmm.h>
 #include <gst/gst.h>
+#include <vector>
+#include "busmonitor.h"
+#include "core.h"
+#include "phases.h"
+#include "trace.h"
 
 const double DEFAULT_THUMBNAIL_SIZE = 128.0;
 const double DEFAULT_START_TIME = 0.0;
@@ -30,25 +35,7 @@ const double DEFAULT_NOISE_THRESHOLD = -100.0;
 const char * DEFAULT_OUTPUT_FILENAME = "thumbnail.png";
 
 using Glib::ustring;
-
-class OptionEntry : public Glib::OptionEntry
-{
-public:
-    OptionEntry (const ustring &long_name = ustring(),
-                 const ustring &description = ustring())
-    {
-        set_long_name (long_name);
-        set_description (description);
-    }
-    OptionEntry (gchar short_name,
-                 const ustring &long_name = ustring(),
-                 const ustring &description = ustring())
-    {
-        set_short_name (short_name);
-        set_long_name (long_name);
-        set_description (description);
-    }
-};
+using soundprint::OptionEntry;
 
 class AppOptions : public Glib::OptionGroup
 {
@@ -62,6 +49,9 @@ public:
           , m_output_file (DEFAULT_OUTPUT_FILENAME)
           , m_start (DEFAULT_START_TIME)
           , m_benchmark (0)
+          , m_max_backlog (0)
+          , m_sync_render (false)
+          , m_montage (0)
     {
         add_entry (OptionEntry ('s', "size",
                                 ustring::compose ("Size in pixels of the generated thumbnail (default %1px)",
@@ -86,6 +76,18 @@ public:
         add_entry (OptionEntry ("benchmark",
                                 "Run the specified number of times and report average time spent"),
                    m_benchmark);
+        add_entry_filename (OptionEntry ("trace",
+                                         "Write a Chrome trace of the run to this file"),
+                            m_trace_file);
+        add_entry (OptionEntry ("max-backlog",
+                                "Block decoding while this many spectrum messages wait (default unlimited)"),
+                   m_max_backlog);
+        add_entry (OptionEntry ("sync-render",
+                                "Paint spectrum columns on the streaming thread instead of the main loop"),
+                   m_sync_render);
+        add_entry (OptionEntry ("montage",
+                                "Compose the thumbnail from this many excerpts spread across the file, decoded concurrently"),
+                   m_montage);
     }
 
     double m_size;
@@ -94,6 +96,10 @@ public:
     std::string m_output_file;
     double m_start;
     int m_benchmark;
+    std::string m_trace_file;
+    int m_max_backlog;
+    bool m_sync_render;
+    int m_montage;
 };
 
 class OptionContext : public Glib::OptionContext
@@ -109,6 +115,10 @@ public:
     AppOptions m_options;
 };
 
+// The thumbnail shows one excerpt of the file, or with --montage several
+// excerpts spread across it.  Every excerpt is decoded by a pipeline of its
+// own, concurrently with the others, and paints its own range of columns;
+// all of them are run from the same main loop.
 class App
 {
 public:
@@ -121,38 +131,111 @@ public:
     , m_sample_height (m_thumbnail_size / m_freq_bands)
     , m_num_samples (m_thumbnail_size)
     , m_freq_bands (m_thumbnail_size)
+    , m_montage (options.m_montage)
     , m_fileuri (fileuri)
     , m_output_file (options.m_output_file)
-    , m_pipeline (0)
-    , m_decoder (0)
-    , m_spectrum (0)
-    , m_sink (0)
-    , m_bus (0)
-    , m_sample_no (0)
-    , m_prerolled (false)
+    , m_renderer (m_thumbnail_size, m_thumbnail_size,
+                  soundprint::Renderer::INVERTED, m_threshold)
+    , m_prerolled (0)
+    , m_finished (0)
+    , m_failed (false)
+    , m_trace (options.m_trace_file.empty () ? 0 : new TraceWriter ())
+    , m_trace_file (options.m_trace_file)
+    , m_max_backlog (options.m_max_backlog)
+    , m_sync_render (options.m_sync_render)
     {
-        // Set up the drawing surface
-        m_surface = Cairo::ImageSurface::create (Cairo::FORMAT_RGB24,
-                                                 m_thumbnail_size,
-                                                 m_thumbnail_size);
-        m_cr = Cairo::Context::create (m_surface);
-        m_cr->set_source_rgb (1.0, 1.0, 1.0);
-        m_cr->paint ();
+        g_mutex_init (&m_paint_lock);
+        m_phases.set_trace (m_trace);
     }
 
     ~App ()
     {
-        g_object_unref (m_bus);
-        g_object_unref (m_pipeline);
+        for (std::vector<Excerpt*>::iterator it = m_excerpts.begin ();
+             it != m_excerpts.end (); ++it)
+            delete *it;
+        delete m_trace;
+        g_mutex_clear (&m_paint_lock);
     }
 
     int run ()
     {
         try {
             m_mainloop = Glib::MainLoop::create();
+
+            int excerpts = m_montage > 0 ? CLAMP (m_montage, 1, m_num_samples) : 1;
+            for (int i = 0; i < excerpts; ++i)
+            {
+                int column = i * m_num_samples / excerpts;
+                int next_column = (i + 1) * m_num_samples / excerpts;
+                m_excerpts.push_back (new Excerpt (*this, i, column,
+                                                   next_column - column));
+                m_excerpts.back ()->build ();
+            }
+
+            m_phases.mark ("setup");
+            for (std::vector<Excerpt*>::iterator it = m_excerpts.begin ();
+                 it != m_excerpts.end (); ++it)
+                (*it)->pause ();
+
+            m_mainloop->run ();
+        } catch (std::exception &e)
+        {
+            stop ();
+            g_printerr ("%s\n", e.what ());
+            return 1;
+        }
+
+        if (m_failed)
+            return 1;
+        if (m_trace && !m_trace->write (m_trace_file))
+            g_warning ("Unable to write trace to '%s'", m_trace_file.c_str ());
+        return 0;
+    }
+
+    const PhaseTimer &phases () const { return m_phases; }
+
+    void add_bus_stats (BusStats &stats) const
+    {
+        for (std::vector<Excerpt*>::const_iterator it = m_excerpts.begin ();
+             it != m_excerpts.end (); ++it)
+            stats.add ((*it)->bus_monitor ());
+    }
+
+private:
+    class Excerpt : public soundprint::ColumnSink
+    {
+    public:
+        Excerpt (App &app, int index, int column, int columns)
+        : m_app (app)
+        , m_index (index)
+        , m_column (column)
+        , m_columns (columns)
+        , m_pipeline (0)
+        , m_decoder (0)
+        , m_spectrum (0)
+        , m_sink (0)
+        , m_bus (0)
+        , m_sample_no (0)
+        , m_prerolled (false)
+        , m_shade_time (0)
+        {}
+
+        ~Excerpt ()
+        {
+            if (m_bus)
+            {
+                gst_bus_remove_signal_watch (m_bus);
+                g_object_unref (m_bus);
+            }
+            if (m_pipeline)
+                g_object_unref (m_pipeline);
+        }
+
+        void build ()
+        {
             m_pipeline = gst_pipeline_new (0);
             m_decoder = gst_element_factory_make ("uridecodebin", 0);
-            m_spectrum = gst_element_factory_make ("spectrum", 0);
+            m_spectrum = m_analyzer.element ();
             m_sink = gst_element_factory_make ("fakesink", 0);
             m_bus = gst_pipeline_get_bus (GST_PIPELINE (m_pipeline));
 
@@ -160,22 +243,27 @@ public:
                               m_decoder, m_spectrum, m_sink, NULL);
 
             g_object_set (m_decoder,
-                          "uri", Glib::filename_to_utf8 (m_fileuri).c_str (),
+                          "uri", Glib::filename_to_utf8 (m_app.m_fileuri).c_str (),
                           NULL);
             g_signal_connect (m_decoder, "pad-added",
                               G_CALLBACK (on_pad_added_proxy), this);
 
-            gint64 interval = (m_spectrogram_length /
-                               static_cast<double>(m_num_samples)) *
+            gint64 interval = (m_app.m_spectrogram_length /
+                               static_cast<double>(m_app.m_num_samples)) *
                 static_cast<double>(GST_SECOND);
-            g_object_set (m_spectrum,
-                          "post-messages", TRUE,
-                          "interval", interval,
-                          "threshold", static_cast<int>(m_threshold),
-                          "bands", m_freq_bands,
-                          NULL);
+            m_analyzer.configure (m_app.m_freq_bands, interval, m_app.m_threshold);
             gst_element_link (m_spectrum, m_sink);
 
+            if (m_app.m_trace)
+            {
+                trace_pad (m_spectrum, "sink", "spectrum sink");
+                trace_pad (m_spectrum, "src", "spectrum src");
+                trace_pad (m_sink, "sink", "sink");
+            }
+            if (m_app.m_sync_render)
+                m_bus_monitor.set_sync_callback (on_sync_element_message, this);
+            m_bus_monitor.attach (m_bus, m_app.m_trace, MAX (m_app.m_max_backlog, 0));
+
             gst_bus_add_signal_watch (m_bus);
 
             g_signal_connect (m_bus, "message::eos",
@@ -188,7 +276,10 @@ public:
                               G_CALLBACK (on_error_message), this);
             g_signal_connect (m_bus, "message::element",
                               G_CALLBACK (on_element_message_proxy), this);
+        }
 
+        void pause ()
+        {
             m_prerolled = (gst_element_set_state (m_pipeline, GST_STATE_PAUSED) ==
                            GST_STATE_CHANGE_SUCCESS);
 
@@ -197,225 +288,245 @@ public:
                 g_signal_connect (m_bus, "message::async-done",
                                   G_CALLBACK (on_async_done_proxy), this);
             }
+        }
 
-            m_mainloop->run ();
-        } catch (std::exception &e)
+        void stop ()
         {
-            gst_element_set_state (m_pipeline, GST_STATE_NULL);
-            g_printerr ("%s", e.what ());
-            return 1;
+            m_bus_monitor.release ();
+            if (m_pipeline)
+                gst_element_set_state (m_pipeline, GST_STATE_NULL);
         }
-        return 0;
-    }
 
-    static void on_pad_added_proxy (GstElement *element,
-                                    GstPad *pad,
-                                    gpointer user_data)
-    {
-        App *self = static_cast<App*>(user_data);
-        self->on_pad_added (element, pad);
-    }
+        const BusMonitor &bus_monitor () const { return m_bus_monitor; }
+        gint64 shade_time () const { return m_shade_time; }
 
-    bool start_pipeline ()
-    {
-        // only process the first X seconds
-        bool success = gst_element_seek (m_pipeline, 1.0, GST_FORMAT_TIME,
-                                         GST_SEEK_FLAG_FLUSH,
-                                         GST_SEEK_TYPE_SET,
-                                         m_start * GST_SECOND,
-                                         GST_SEEK_TYPE_SET,
-                                         (m_start + m_spectrogram_length) * GST_SECOND);
+    private:
+        void trace_pad (GstElement *element, const char *pad_name,
+                        const std::string &name)
+        {
+            GstPad *pad = gst_element_get_static_pad (element, pad_name);
+            m_app.m_trace->probe_pad (pad, name);
+            gst_object_unref (pad);
+        }
 
-        if (!success)
-            g_warning ("Failed to seek to first %g seconds", m_spectrogram_length);
+        static void on_pad_added_proxy (GstElement *element,
+                                        GstPad *pad,
+                                        gpointer user_data)
+        {
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            self->on_pad_added (element, pad);
+        }
 
-        gst_element_set_state (m_pipeline, GST_STATE_PLAYING);
+        // A montage centres each excerpt on its share of the file and makes
+        // it as long as its share of the columns, so the columns keep the
+        // time scale of a single excerpt.
+        void place (double &start, double &length)
+        {
+            length = m_app.m_spectrogram_length * m_columns / m_app.m_num_samples;
 
-        return false;
-    }
+            gint64 duration = 0;
+            if (!gst_element_query_duration (m_pipeline, GST_FORMAT_TIME, &duration) ||
+                duration <= 0)
+            {
+                g_warning ("Unable to query the duration, using consecutive excerpts");
+                start = m_app.m_start +
+                    m_app.m_spectrogram_length * m_column / m_app.m_num_samples;
+                return;
+            }
 
-    void on_pad_added (GstElement *, GstPad *pad)
-    {
-        GstCaps *caps = gst_pad_query_caps (pad, NULL);
-        GstStructure *structure = gst_caps_get_structure (caps, 0);
-        const char *name = gst_structure_get_name (structure);
+            double seconds = static_cast<double>(duration) / GST_SECOND;
+            int excerpts = m_app.m_excerpts.size ();
+            start = seconds * (2 * m_index + 1) / (2 * excerpts) - length / 2.0;
+            start = CLAMP (start, 0.0, MAX (seconds - length, 0.0));
+        }
+
+        bool start_pipeline ()
+        {
+            // the phases end with the last excerpt
+            bool last = (++m_app.m_prerolled == m_app.m_excerpts.size ());
+            if (last)
+                m_app.m_phases.mark ("preroll");
+
+            double start = m_app.m_start;
+            double length = m_app.m_spectrogram_length;
+            if (m_app.m_montage > 0)
+                place (start, length);
+
+            // only process the first X seconds
+            m_bus_monitor.release ();
+            bool success = gst_element_seek (m_pipeline, 1.0, GST_FORMAT_TIME,
+                                             GST_SEEK_FLAG_FLUSH,
+                                             GST_SEEK_TYPE_SET,
+                                             start * GST_SECOND,
+                                             GST_SEEK_TYPE_SET,
+                                             (start + length) * GST_SECOND);
+            m_bus_monitor.rearm ();
+
+            if (!success)
+                g_warning ("Failed to seek to %g seconds from %gs", length, start);
+            if (last)
+                m_app.m_phases.mark ("seek");
+
+            gst_element_set_state (m_pipeline, GST_STATE_PLAYING);
+
+            return false;
+        }
 
-        if (g_str_has_prefix (name, "audio/"))
+        void on_pad_added (GstElement *, GstPad *pad)
         {
-            GstPad *spectrum_pad =
-                gst_element_get_static_pad (m_spectrum, "sink");
+            try {
+                if (!soundprint::link_audio_pad (pad, m_spectrum))
+                    return;
+            } catch (std::exception &e)
+            {
+                g_warning ("%s", e.what ());
+                return;
+            }
 
-            if (!gst_pad_link (pad, spectrum_pad) == GST_PAD_LINK_OK)
-                g_warning ("unable to link pad");
+            if (m_app.m_trace)
+                m_app.m_trace->probe_pad (pad, "decoder");
 
             if (m_prerolled)
                 Glib::signal_idle ().connect (sigc::mem_fun (this,
-                                                             &App::start_pipeline));
+                                                             &Excerpt::start_pipeline));
         }
-        gst_caps_unref (caps);
-    }
-
-    static void on_error_message (GstBus *, GstMessage *message, gpointer)
-    {
-        GError *error = NULL;
-        gchar *debug = NULL;
 
-        switch (message->type)
+        static void on_error_message (GstBus *, GstMessage *message,
+                                      gpointer user_data)
         {
-            case GST_MESSAGE_INFO:
-                gst_message_parse_info (message, &error, &debug);
-                break;
-            case GST_MESSAGE_WARNING:
-                gst_message_parse_warning (message, &error, &debug);
-                break;
-            case GST_MESSAGE_ERROR:
-                gst_message_parse_error (message, &error, &debug);
-                break;
-            default:
-                g_warning ("unexpected message type");
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            std::string error = soundprint::report_message (message);
+            if (!error.empty ())
+                self->m_app.fail (error);
         }
 
-        if (error)
-            g_print ("%s", error->message);
-        if (debug)
-            g_print ("%s", debug);
+        static void on_eos_proxy (GstBus *,
+                                  GstMessage *,
+                                  gpointer user_data)
+        {
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            self->m_app.on_eos (*self);
+        }
 
-        if (message->type == GST_MESSAGE_ERROR)
-            throw std::runtime_error (debug);
+        static void on_element_message_proxy (GstBus *,
+                                              GstMessage *message,
+                                              gpointer user_data)
+        {
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            self->m_bus_monitor.delivered (message);
+            self->m_analyzer.dispatch (gst_message_get_structure (message), *self);
+        }
 
-        g_clear_error (&error);
-        g_free (debug);
-    }
+        // paints spectrum messages on the streaming thread that posted them
+        static bool on_sync_element_message (GstMessage *message,
+                                             gpointer user_data)
+        {
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            return self->m_analyzer.dispatch (gst_message_get_structure (message),
+                                              *self);
+        }
 
-    static void on_eos_proxy (GstBus *bus,
-                              GstMessage *message,
-                              gpointer user_data)
-    {
-        App *self = static_cast<App*>(user_data);
-        self->on_eos (bus, message);
-    }
+        void on_column (GstClockTime, const std::vector<float> &levels)
+        {
+            // if I ask for an interval that is equal to LENGTH/NUM_SAMPLES, this
+            // will result in NUM_SAMPLES+1 messages being emitted, so just ignore
+            // messages that are beyond our columns.
+            if (m_sample_no >= m_columns)
+                return;
+
+            int column = m_column + m_sample_no;
+            gint64 start = g_get_monotonic_time ();
+            // with --sync-render, excerpts paint from their own streaming
+            // threads
+            g_mutex_lock (&m_app.m_paint_lock);
+            m_app.m_renderer.paint_column (column, levels);
+            g_mutex_unlock (&m_app.m_paint_lock);
+
+            gint64 end = g_get_monotonic_time ();
+            m_shade_time += end - start;
+            if (m_app.m_trace && column % TRACE_COLUMN_INTERVAL == 0)
+                m_app.m_trace->complete ("paint", "paint column", start, end,
+                                         ustring::compose ("{\"column\":%1}", column));
+            ++m_sample_no;
+        }
 
-    void on_eos (GstBus *, GstMessage *)
-    {
-        gst_element_set_state (m_pipeline, GST_STATE_NULL);
+        static void on_async_done_proxy (GstBus *bus,
+                                         GstMessage *message,
+                                         gpointer user_data)
+        {
+            Excerpt *self = static_cast<Excerpt*>(user_data);
+            self->on_async_done (bus, message);
+        }
 
-        m_surface->write_to_png (m_output_file);
-        m_mainloop->quit ();
-    }
+        void on_async_done (GstBus *, GstMessage *)
+        {
+            if (m_prerolled)
+                return;
 
-    static void on_element_message_proxy (GstBus *bus,
-                                          GstMessage *message,
-                                          gpointer user_data)
-    {
-        App *self = static_cast<App*>(user_data);
-        const GstStructure *structure = gst_message_get_structure (message);
-        if (gst_structure_has_name (structure, "spectrum"))
-            self->on_spectrum (bus, structure);
-    }
+            m_prerolled = true;
+            start_pipeline ();
+            g_signal_handlers_disconnect_by_func (m_bus,
+                                                  (gpointer)on_async_done_proxy,
+                                                  this);
+        }
 
-    // example data:
-    // spectrum, endtime=(guint64)189252222222, timestamp=(guint64)189152222222,
-    // stream-time=(guint64)189152222222, running-time=(guint64)189152222222,
-    // duration=(guint64)100000000, magnitude=(float){ -36.146251678466797,
-    // -22.013933181762695, -27.303266525268555, -39.544231414794922,
-    // -47.111648559570312, -48.796600341796875, -51.38055419921875,
-    // -52.118595123291016, -48.332794189453125, -50.224254608154297,
-    // -54.032829284667969, -47.853244781494141, -48.721431732177734,
-    // -54.715785980224609, -53.286895751953125, -57.693508148193359,
-    // -59.937911987304688, -59.571735382080078, -57.537551879882812,
-    // -58.367549896240234, -59.908416748046875, -59.729766845703125, -60, -60,
-    // -60, -59.997806549072266, -59.669063568115234, -58.566783905029297,
-    // -57.596271514892578, -57.8333740234375, -59.022228240966797,
-    // -59.885730743408203, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60, -60,
-    // -60, -60 };
-
-    void on_spectrum (GstBus *, const GstStructure *structure)
+        App &m_app;
+        int m_index;
+        int m_column;
+        int m_columns;
+
+        GstElement *m_pipeline;
+        GstElement *m_decoder; // weak ref
+        GstElement *m_spectrum; // weak ref
+        GstElement *m_sink; // weak ref
+        GstBus *m_bus;
+
+        soundprint::Analyzer m_analyzer;
+        int m_sample_no;
+        bool m_prerolled;
+        gint64 m_shade_time;
+        BusMonitor m_bus_monitor;
+    };
+
+    void stop ()
     {
-        g_assert (m_cr);
-
-        // if I ask for an interval that is equal to LENGTH/NUM_SAMPLES, this
-        // will result in NUM_SAMPLES+1 messages being emitted, so just ignore
-        // messages that are beyond our size.
-        if (m_sample_no > m_thumbnail_size)
-            return;
-
-        const GValue *val = gst_structure_get_value (structure, "magnitude");
-        int size = gst_value_list_get_size (val);
-        int i;
-
-        // the inflection point between the two halves of the alpha formula
-        const float TX = 0.6;
-        const float TY = 0.85;
-        // multiplier for the first segment
-        const float k = (1 / TX) * (1 / TX) * TY;
-        // slope and offset of the second segment
-        static const float m = (1.0 - TY) / (1.0 - TX);
-        static const float b = TY - m * TX;
-        unsigned char *data = m_surface->get_data ();
-        const int stride = m_surface->format_stride_for_width (Cairo::FORMAT_RGB24, m_thumbnail_size);
-
-        m_surface->flush ();
-        for (i = 0; i < size; ++i)
-        {
-            const GValue *floatval = gst_value_list_get_value (val, i);
-            float v = g_value_get_float (floatval);
-            double shade = (v - m_threshold) / std::abs(m_threshold);
-            if (shade > 0.0)
-            {
-                unsigned char *pixel = data + ((size - 1 - i) * stride) +
-                    m_sample_no * sizeof (guint32);
-                // Try to decrease the background noise a bit while making the
-                // foreground noise stand out a bit better.  From 0 to T, we
-                // use a parabolic (squared) slope to de-emphasize the lower
-                // levels, and from T and up, we simply map the aplitude
-                // directly to the alpha.
-                if (shade < TX)
-                {
-                    shade = k * shade * shade;
-                }
-                else
-                {
-                    shade = m * shade + b;
-                }
-
-                // clamp value betwen 0.0 and 1.0, just in case
-                unsigned int byte = 0xFF - (std::max (0.0, std::min (1.0, shade)) * 0xFF);
-
-                memset (pixel, byte, sizeof (guint32));
-            }
-        }
-        m_surface->mark_dirty ();
-        ++m_sample_no;
+        for (std::vector<Excerpt*>::iterator it = m_excerpts.begin ();
+             it != m_excerpts.end (); ++it)
+            (*it)->stop ();
     }
 
-    static void on_async_done_proxy (GstBus *bus,
-                                     GstMessage *message,
-                                     gpointer user_data)
+    void fail (const std::string &message)
     {
-        App *self = static_cast<App*>(user_data);
-        self->on_async_done (bus, message);
+        g_printerr ("%s\n", message.c_str ());
+        m_failed = true;
+        stop ();
+        m_mainloop->quit ();
     }
 
-    void on_async_done (GstBus *, GstMessage *)
+    void on_eos (Excerpt &excerpt)
     {
-        if (m_prerolled)
+        if (++m_finished < m_excerpts.size ())
+        {
+            excerpt.stop ();
             return;
+        }
 
-        m_prerolled = true;
-        start_pipeline ();
-        g_signal_handlers_disconnect_by_func (m_bus,
-                                              (gpointer)on_async_done_proxy,
-                                              this);
+        // with --sync-render the streaming threads are done painting by now,
+        // since they posted every spectrum message before EOS
+        gint64 shade_time = 0;
+        for (std::vector<Excerpt*>::iterator it = m_excerpts.begin ();
+             it != m_excerpts.end (); ++it)
+            shade_time += (*it)->shade_time ();
+        m_phases.add ("shade", shade_time);
+        m_phases.mark ("decode+fft");
+        excerpt.stop ();
+        m_phases.mark ("teardown");
+
+        soundprint::Encoder (m_output_file).write (m_renderer.surface ());
+        m_phases.mark ("png");
+        m_mainloop->quit ();
     }
 
-
-private:
     Glib::RefPtr<Glib::MainLoop> m_mainloop;
 
     double m_spectrogram_length;
@@ -426,21 +537,23 @@ private:
     double m_sample_height;
     int m_num_samples;
     int m_freq_bands;
+    int m_montage;
 
     std::string m_fileuri;
     std::string m_output_file;
 
-    GstElement *m_pipeline;
-    GstElement *m_decoder; // weak ref
-    GstElement *m_spectrum; // weak ref
-    GstElement *m_sink; // weak ref
-    GstBus *m_bus;
-
-    Cairo::RefPtr<Cairo::ImageSurface> m_surface;
-    Cairo::RefPtr<Cairo::Context> m_cr;
-
-    int m_sample_no;
-    bool m_prerolled;
+    std::vector<Excerpt*> m_excerpts;
+    soundprint::Renderer m_renderer;
+    GMutex m_paint_lock;
+
+    guint m_prerolled;
+    guint m_finished;
+    bool m_failed;
+    PhaseTimer m_phases;
+    TraceWriter *m_trace;
+    std::string m_trace_file;
+    int m_max_backlog;
+    bool m_sync_render;
 };
 
 int main (int argc, char** argv)
@@ -450,7 +563,9 @@ int main (int argc, char** argv)
     try
     {
         OptionContext octx;
+        gint64 init_start = g_get_monotonic_time ();
         octx.parse (argc, argv);
+        gint64 init_time = g_get_monotonic_time () - init_start;
 
         if (argc != 2)
         {
@@ -463,15 +578,25 @@ int main (int argc, char** argv)
         if (iterations > 0)
         {
             Glib::Timer timer;
+            PhaseStats stats;
+            BusStats bus_stats;
             for (int i = 0; i < octx.m_options.m_benchmark; ++i)
             {
                 App app (argv[1], octx.m_options);
-                app.run();
+                // run() has reported the failure already
+                if (app.run () != 0)
+                    return 1;
+                stats.add (app.phases ());
+                app.add_bus_stats (bus_stats);
                 g_print (".");
             }
             double elapsed = timer.elapsed ();
             g_print ("\nTotal time elepased: %g\n", elapsed);
             g_print ("Mean iteration time: %g\n", elapsed / iterations);
+            g_print ("GStreamer init: %.3f ms\n\n", init_time / 1000.0);
+            stats.print ();
+            bus_stats.print ();
+            return 0;
         }
         else
         {
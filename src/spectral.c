@@ -0,0 +1,190 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#include <float.h>
+#include <string.h>
+#include "spectral.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 10 * log10 (2), converts log2 of a power to dB */
+#define DB_PER_LOG2 3.01029995664f
+
+/* log2 (1 + x) for x in [0, 1), minimax fit with p(0) = 0 so that exact
+ * powers of two stay exact.  The maximum error is 7.7e-4, i.e. 0.0023 dB */
+#define LOG2_C1 1.42459687f
+#define LOG2_C2 -0.589221354f
+#define LOG2_C3 0.165397457f
+
+static inline gfloat
+fast_log2 (gfloat v)
+{
+  union { gfloat f; guint32 i; } u;
+  gfloat e, x;
+
+  /* also maps 0 (silence) to a finite value, clamped by the caller */
+  u.f = MAX (v, FLT_MIN);
+  e = (gfloat) ((gint32) (u.i >> 23) - 127);
+  u.i = (u.i & 0x007fffff) | 0x3f800000;
+  x = u.f - 1.0f;
+
+  return e + x * (LOG2_C1 + x * (LOG2_C2 + x * LOG2_C3));
+}
+
+static inline gfloat
+power_to_db (const gfloat * bin, gfloat scale, gfloat threshold)
+{
+  gfloat db = DB_PER_LOG2 *
+      fast_log2 ((bin[0] * bin[0] + bin[1] * bin[1]) * scale);
+
+  return MAX (db, threshold);
+}
+
+#ifdef __SSE2__
+/* four bins, i.e. eight floats, at a time */
+static inline __m128
+power_to_db_sse2 (const gfloat * bins, __m128 scale, __m128 threshold)
+{
+  const __m128 lo = _mm_loadu_ps (bins);
+  const __m128 hi = _mm_loadu_ps (bins + 4);
+  const __m128 lo2 = _mm_mul_ps (lo, lo);
+  const __m128 hi2 = _mm_mul_ps (hi, hi);
+  __m128 p, x, e, poly;
+  __m128i bits;
+
+  /* de-interleave re^2 and im^2 and add them up */
+  p = _mm_add_ps (_mm_shuffle_ps (lo2, hi2, _MM_SHUFFLE (2, 0, 2, 0)),
+      _mm_shuffle_ps (lo2, hi2, _MM_SHUFFLE (3, 1, 3, 1)));
+  p = _mm_max_ps (_mm_mul_ps (p, scale), _mm_set1_ps (FLT_MIN));
+
+  bits = _mm_castps_si128 (p);
+  e = _mm_cvtepi32_ps (_mm_sub_epi32 (_mm_srli_epi32 (bits, 23),
+          _mm_set1_epi32 (127)));
+  x = _mm_castsi128_ps (_mm_or_si128 (_mm_and_si128 (bits,
+              _mm_set1_epi32 (0x007fffff)), _mm_set1_epi32 (0x3f800000)));
+  x = _mm_sub_ps (x, _mm_set1_ps (1.0f));
+
+  poly = _mm_add_ps (_mm_set1_ps (LOG2_C2),
+      _mm_mul_ps (x, _mm_set1_ps (LOG2_C3)));
+  poly = _mm_add_ps (_mm_set1_ps (LOG2_C1), _mm_mul_ps (x, poly));
+  poly = _mm_add_ps (e, _mm_mul_ps (x, poly));
+
+  return _mm_max_ps (_mm_mul_ps (poly, _mm_set1_ps (DB_PER_LOG2)), threshold);
+}
+#endif
+
+void
+spectral_power_to_db (const gfloat * bins, gfloat * db, guint n,
+    gfloat scale, gfloat threshold)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  const __m128 vscale = _mm_set1_ps (scale);
+  const __m128 vthreshold = _mm_set1_ps (threshold);
+
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps (db + i,
+        power_to_db_sse2 (bins + 2 * i, vscale, vthreshold));
+#endif
+
+  for (; i < n; i++)
+    db[i] = power_to_db (bins + 2 * i, scale, threshold);
+}
+
+void
+spectral_power_to_db_add (const gfloat * bins, gfloat * db, guint n,
+    gfloat scale, gfloat threshold)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  const __m128 vscale = _mm_set1_ps (scale);
+  const __m128 vthreshold = _mm_set1_ps (threshold);
+
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps (db + i, _mm_add_ps (_mm_loadu_ps (db + i),
+            power_to_db_sse2 (bins + 2 * i, vscale, vthreshold)));
+#endif
+
+  for (; i < n; i++)
+    db[i] += power_to_db (bins + 2 * i, scale, threshold);
+}
+
+/* the inflection point between the two halves of the shading curve */
+#define SHADE_TX 0.6
+#define SHADE_TY 0.85
+
+gdouble
+spectral_shade (gdouble db, gdouble threshold)
+{
+  /* multiplier for the first segment */
+  const gdouble k = (1 / SHADE_TX) * (1 / SHADE_TX) * SHADE_TY;
+  /* slope and offset of the second segment */
+  const gdouble m = (1.0 - SHADE_TY) / (1.0 - SHADE_TX);
+  const gdouble b = SHADE_TY - m * SHADE_TX;
+  gdouble shade = (db - threshold) / ABS (threshold);
+
+  if (shade <= 0.0)
+    return 0.0;
+
+  /* From 0 to TX a parabolic slope de-emphasizes the lower levels, from TX
+   * up the amplitude maps directly to the shade */
+  if (shade < SHADE_TX)
+    shade = k * shade * shade;
+  else
+    shade = m * shade + b;
+
+  return MIN (shade, 1.0);
+}
+
+void
+spectral_paint_column_inverted (const gfloat * db, guint n, gfloat threshold,
+    guint8 * bottom, gint stride)
+{
+  guint i;
+
+  for (i = 0; i < n; i++) {
+    if (db[i] > threshold) {
+      guint8 byte = 0xff - (guint8) (spectral_shade (db[i], threshold) * 0xff);
+
+      memset (bottom - (gssize) i * stride, byte, 4);
+    }
+  }
+}
+
+void
+spectral_paint_column_alpha (const gfloat * db, guint n, gfloat threshold,
+    guint8 * bottom, gint stride)
+{
+  guint i;
+
+  for (i = 0; i < n; i++) {
+    if (db[i] > threshold) {
+      guint8 *pixel = bottom - (gssize) i * stride;
+
+      memset (pixel, 0, 4);
+      pixel[3] = (guint8) (spectral_shade (db[i], threshold) * 0xff);
+    }
+  }
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#ifndef __SPECTRAL_H__
+#define __SPECTRAL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Batch kernels shared by the spectrogram plugin and the command line tools.
+ *
+ * The dB conversions take an array of n interleaved complex bins (re, im),
+ * compute 10 * log10 ((re * re + im * im) * scale) and clamp the result to
+ * threshold.  The logarithm is a bit-trick/polynomial approximation that is
+ * accurate to within 0.0023 dB of the exact value over the whole float range,
+ * and is vectorized with SSE2 where available.
+ */
+void spectral_power_to_db (const gfloat * bins, gfloat * db, guint n,
+    gfloat scale, gfloat threshold);
+
+/* like spectral_power_to_db(), but adds the result to db[] */
+void spectral_power_to_db_add (const gfloat * bins, gfloat * db, guint n,
+    gfloat scale, gfloat threshold);
+
+/* Maps a level in dB to a shade from 0.0 (at or below threshold) to 1.0
+ * (0 dB).  The lower levels are de-emphasized so that background noise stays
+ * faint and the foreground stands out. */
+gdouble spectral_shade (gdouble db, gdouble threshold);
+
+/* Paint n levels as one column of 32 bit pixels, lowest band at bottom and
+ * going up by stride bytes per band.  Levels at or below threshold leave
+ * their pixel untouched.
+ *
+ * The _inverted variant sets all four bytes to 255 - shade, i.e. dark on
+ * white; the _alpha variant sets the pixel to black with an alpha of shade.
+ */
+void spectral_paint_column_inverted (const gfloat * db, guint n,
+    gfloat threshold, guint8 * bottom, gint stride);
+void spectral_paint_column_alpha (const gfloat * db, guint n,
+    gfloat threshold, guint8 * bottom, gint stride);
+
+G_END_DECLS
+
+#endif /* __SPECTRAL_H__ */
@@ -0,0 +1,222 @@
+/*******************************************************************************
+ *
+ *  Copyright (c) 2011 Jonathon Jongsma
+ *
+ *  This file is part of soundprint
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ *******************************************************************************/
+
+#ifndef SOUNDPRINT_TRACE_H
+#define SOUNDPRINT_TRACE_H
+
+#include <gst/gst.h>
+#include <cstdio>
+#include <map>
+#include <string>
+
+// only every this many columns gets a paint event in the trace
+const int TRACE_COLUMN_INTERVAL = 16;
+
+// Collects Chrome trace events (the JSON format that chrome://tracing and
+// Perfetto load) from any thread and writes them out at the end of a run.
+// Timestamps are g_get_monotonic_time () microseconds.
+class TraceWriter
+{
+public:
+    // the thread creating the writer is named "main"
+    TraceWriter ()
+        : m_next_tid (1)
+    {
+        g_mutex_init (&m_lock);
+        m_threads[g_thread_self ()] = m_next_tid;
+        name_track (m_next_tid++, "main");
+    }
+
+    ~TraceWriter ()
+    {
+        g_mutex_clear (&m_lock);
+    }
+
+    // a span on the calling thread
+    void complete (const char *category, const std::string &name,
+                   gint64 start, gint64 end, const std::string &args = "{}")
+    {
+        g_mutex_lock (&m_lock);
+        append (format ("{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\","
+                        "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT
+                        ",\"pid\":1,\"tid\":%d,\"args\":%s}",
+                        category, name.c_str (), start, MAX (end - start, 0),
+                        thread_id (), args.c_str ()));
+        g_mutex_unlock (&m_lock);
+    }
+
+    // a span on a track of its own, for things that are not a thread
+    void complete_on (const char *track, const char *category,
+                      const std::string &name, gint64 start, gint64 end,
+                      const std::string &args = "{}")
+    {
+        g_mutex_lock (&m_lock);
+        append (format ("{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\","
+                        "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT
+                        ",\"pid\":1,\"tid\":%d,\"args\":%s}",
+                        category, name.c_str (), start, MAX (end - start, 0),
+                        track_id (track), args.c_str ()));
+        g_mutex_unlock (&m_lock);
+    }
+
+    void counter (const char *name, gint64 value)
+    {
+        g_mutex_lock (&m_lock);
+        append (format ("{\"ph\":\"C\",\"name\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+                        ",\"pid\":1,\"args\":{\"value\":%" G_GINT64_FORMAT "}}",
+                        name, g_get_monotonic_time (), value));
+        g_mutex_unlock (&m_lock);
+    }
+
+    // Traces the streaming thread through pad: every buffer passing a
+    // probed pad ends a span, named after the pads on either end, that
+    // started at the previous probed pad the same thread went through.
+    // The span between an element's sink and source pads is the time the
+    // element spent on the buffer.
+    void probe_pad (GstPad *pad, const std::string &name)
+    {
+        gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+                           on_probe, new Probe (this, name), destroy_probe);
+    }
+
+    bool write (const std::string &filename)
+    {
+        FILE *f = std::fopen (filename.c_str (), "w");
+        if (!f)
+            return false;
+
+        g_mutex_lock (&m_lock);
+        std::fprintf (f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n%s\n]}\n",
+                      m_events.c_str ());
+        g_mutex_unlock (&m_lock);
+
+        return std::fclose (f) == 0;
+    }
+
+private:
+    struct Probe
+    {
+        Probe (TraceWriter *t, const std::string &n) : trace (t), name (n) {}
+        TraceWriter *trace;
+        std::string name;
+    };
+
+    struct LastProbe
+    {
+        std::string pad;
+        gint64 time;
+    };
+
+    static void destroy_probe (gpointer data)
+    {
+        delete static_cast<Probe*>(data);
+    }
+
+    static GstPadProbeReturn on_probe (GstPad *, GstPadProbeInfo *info,
+                                       gpointer data)
+    {
+        Probe *probe = static_cast<Probe*>(data);
+        probe->trace->on_buffer (probe->name, GST_PAD_PROBE_INFO_BUFFER (info));
+        return GST_PAD_PROBE_OK;
+    }
+
+    void on_buffer (const std::string &pad, GstBuffer *buffer)
+    {
+        gint64 now = g_get_monotonic_time ();
+
+        g_mutex_lock (&m_lock);
+        LastProbe &last = m_last_probe[g_thread_self ()];
+        if (!last.pad.empty ())
+        {
+            append (format ("{\"ph\":\"X\",\"cat\":\"streaming\","
+                            "\"name\":\"%s > %s\",\"ts\":%" G_GINT64_FORMAT
+                            ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d,"
+                            "\"args\":{\"pts\":%" G_GUINT64_FORMAT "}}",
+                            last.pad.c_str (), pad.c_str (), last.time,
+                            now - last.time, thread_id (),
+                            GST_BUFFER_PTS (buffer)));
+        }
+        last.pad = pad;
+        last.time = now;
+        g_mutex_unlock (&m_lock);
+    }
+
+    // the id of the calling thread, which is a streaming thread when it is
+    // new; called with the lock held
+    int thread_id ()
+    {
+        std::map<GThread*, int>::iterator it = m_threads.find (g_thread_self ());
+        if (it != m_threads.end ())
+            return it->second;
+
+        int tid = m_next_tid++;
+        m_threads[g_thread_self ()] = tid;
+        name_track (tid, format ("streaming %d", tid));
+        return tid;
+    }
+
+    int track_id (const char *track)
+    {
+        std::map<std::string, int>::iterator it = m_tracks.find (track);
+        if (it != m_tracks.end ())
+            return it->second;
+
+        int tid = m_next_tid++;
+        m_tracks[track] = tid;
+        name_track (tid, track);
+        return tid;
+    }
+
+    void name_track (int tid, const std::string &name)
+    {
+        append (format ("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                        "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        tid, name.c_str ()));
+    }
+
+    void append (const std::string &event)
+    {
+        if (!m_events.empty ())
+            m_events += ",\n";
+        m_events += event;
+    }
+
+    static std::string format (const char *fmt, ...)
+    {
+        va_list args;
+        va_start (args, fmt);
+        gchar *str = g_strdup_vprintf (fmt, args);
+        va_end (args);
+
+        std::string result (str);
+        g_free (str);
+        return result;
+    }
+
+    GMutex m_lock;
+    std::string m_events;
+    std::map<GThread*, int> m_threads;
+    std::map<std::string, int> m_tracks;
+    std::map<GThread*, LastProbe> m_last_probe;
+    int m_next_tid;
+};
+
+#endif // SOUNDPRINT_TRACE_H